@@ -0,0 +1,238 @@
+/*
+ * kd_lite.h - Lightweight chroma and key-profile classifier
+ *
+ * An alternative to libkeyfinder's analysis for low-power setups: chroma
+ * from a 4096-point FFT (hop 2048) binned to semitones, and keys
+ * classified by correlating the pitch-class sum with Krumhansl-Kessler
+ * or Temperley key profiles.  It has a coarser low end and plainer
+ * profiles than libkeyfinder's 16384-point constant-Q spectral kernel,
+ * and costs a small fraction of the CPU and memory.
+ *
+ * Frames use the wrapper's layout: KD_LITE_BANDS = 6 octaves x 12
+ * semitones, band 0 = A, so key indices come out in libkeyfinder order
+ * (0 = A maj, 1 = A min, ... 23 = Ab min, 24 = silence).
+ *
+ * The FFT is an in-house radix-2 real transform on split re/im arrays
+ * with per-stage twiddle tables, so every butterfly pass is a unit-stride
+ * loop the compiler can vectorise.  The tables depend only on the sample
+ * rate and are shared, read-only, by every stream at that rate; each
+ * stream carries just its sample history.  Header-only, like
+ * kd_resampler.h; nothing allocates, tables and state are fixed-size.
+ */
+
+#ifndef KD_LITE_H
+#define KD_LITE_H
+
+#include <cmath>
+#include <cstring>
+
+#include <stdint.h>
+
+#define KD_LITE_FFT     4096
+#define KD_LITE_HALF    (KD_LITE_FFT / 2)     /* complex FFT size behind the real one */
+#define KD_LITE_HOP     2048
+#define KD_LITE_BANDS   72
+#define KD_LITE_LOW_HZ  55.0                  /* band 0: A1 */
+#define KD_LITE_SILENCE 24
+
+#define KD_LITE_KRUMHANSL 0
+#define KD_LITE_TEMPERLEY 1
+
+struct kd_lite_tables {
+    int rate;
+    float window[KD_LITE_FFT];                 /* Hann */
+    int16_t bitrev[KD_LITE_HALF];
+    float tw_re[KD_LITE_HALF];                 /* stage of half-size h at [h, 2h) */
+    float tw_im[KD_LITE_HALF];
+    float post_re[KD_LITE_HALF + 1];           /* real-FFT split twiddles */
+    float post_im[KD_LITE_HALF + 1];
+    int16_t bin_band[KD_LITE_HALF + 1];        /* band per FFT bin, -1 = outside */
+    float profiles[2][2][12];                  /* [profile][major, minor][degree], zero mean, unit norm */
+};
+
+/* Per-stream state */
+struct kd_lite {
+    float hist[KD_LITE_FFT];                   /* newest KD_LITE_FFT samples, oldest first */
+    int filled;                                /* valid samples in hist, <= KD_LITE_FFT */
+    int since;                                 /* samples since the last FFT frame */
+};
+
+static inline void kd_lite_tables_init(kd_lite_tables *t, int rate) {
+    const double pi = 3.14159265358979323846;
+    t->rate = rate;
+
+    for (int i = 0; i < KD_LITE_FFT; i++) {
+        t->window[i] = (float)(0.5 - 0.5 * std::cos(2.0 * pi * i / KD_LITE_FFT));
+    }
+
+    int bits = 0;
+    while ((1 << bits) < KD_LITE_HALF) bits++;
+    for (int i = 0; i < KD_LITE_HALF; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+        t->bitrev[i] = (int16_t)r;
+    }
+
+    /* Stage with butterflies of half-size h uses w^j = e^(-i pi j / h) */
+    t->tw_re[0] = 1.0f;
+    t->tw_im[0] = 0.0f;
+    for (int h = 1; h < KD_LITE_HALF; h <<= 1) {
+        for (int j = 0; j < h; j++) {
+            t->tw_re[h + j] = (float)std::cos(-pi * j / h);
+            t->tw_im[h + j] = (float)std::sin(-pi * j / h);
+        }
+    }
+    for (int k = 0; k <= KD_LITE_HALF; k++) {
+        t->post_re[k] = (float)std::cos(-2.0 * pi * k / KD_LITE_FFT);
+        t->post_im[k] = (float)std::sin(-2.0 * pi * k / KD_LITE_FFT);
+    }
+
+    /* Nearest semitone per bin; DC and the bins below half a semitone
+     * under A1, or past the top band, are ignored */
+    for (int k = 0; k <= KD_LITE_HALF; k++) {
+        double hz = (double)k * rate / KD_LITE_FFT;
+        int band = -1;
+        if (k > 0) {
+            double st = 12.0 * std::log2(hz / KD_LITE_LOW_HZ);
+            int b = (int)std::floor(st + 0.5);
+            if (b >= 0 && b < KD_LITE_BANDS) band = b;
+        }
+        t->bin_band[k] = (int16_t)band;
+    }
+
+    /* Degree 0 = tonic.  Krumhansl & Kessler (1982) probe-tone ratings;
+     * Temperley (2007) Kostka-Payne corpus frequencies. */
+    static const float raw[2][2][12] = {
+        { { 6.35f, 2.23f, 3.48f, 2.33f, 4.38f, 4.09f, 2.52f, 5.19f, 2.39f, 3.66f, 2.29f, 2.88f },
+          { 6.33f, 2.68f, 3.52f, 5.38f, 2.60f, 3.53f, 2.54f, 4.75f, 3.98f, 2.69f, 3.34f, 3.17f } },
+        { { 0.748f, 0.060f, 0.488f, 0.082f, 0.670f, 0.460f, 0.096f, 0.715f, 0.104f, 0.366f, 0.057f, 0.400f },
+          { 0.712f, 0.084f, 0.474f, 0.618f, 0.049f, 0.460f, 0.105f, 0.747f, 0.404f, 0.067f, 0.133f, 0.330f } },
+    };
+    for (int p = 0; p < 2; p++) {
+        for (int m = 0; m < 2; m++) {
+            double mean = 0.0, norm = 0.0;
+            for (int d = 0; d < 12; d++) mean += raw[p][m][d];
+            mean /= 12.0;
+            for (int d = 0; d < 12; d++) norm += (raw[p][m][d] - mean) * (raw[p][m][d] - mean);
+            norm = std::sqrt(norm);
+            for (int d = 0; d < 12; d++) t->profiles[p][m][d] = (float)((raw[p][m][d] - mean) / norm);
+        }
+    }
+}
+
+static inline void kd_lite_reset(kd_lite *s) {
+    std::memset(s->hist, 0, sizeof(s->hist));
+    s->filled = 0;
+    s->since = 0;
+}
+
+/* In-place complex FFT of KD_LITE_HALF points, split re/im */
+static inline void kd_lite_fft(const kd_lite_tables *t, float *re, float *im) {
+    for (int i = 0; i < KD_LITE_HALF; i++) {
+        int j = t->bitrev[i];
+        if (j > i) {
+            float r = re[i]; re[i] = re[j]; re[j] = r;
+            float m = im[i]; im[i] = im[j]; im[j] = m;
+        }
+    }
+    for (int h = 1; h < KD_LITE_HALF; h <<= 1) {
+        const float *wr = t->tw_re + h;
+        const float *wi = t->tw_im + h;
+        for (int base = 0; base < KD_LITE_HALF; base += 2 * h) {
+            float *ar = re + base, *ai = im + base;
+            float *br = ar + h, *bi = ai + h;
+            for (int j = 0; j < h; j++) {
+                float xr = br[j] * wr[j] - bi[j] * wi[j];
+                float xi = br[j] * wi[j] + bi[j] * wr[j];
+                br[j] = ar[j] - xr;
+                bi[j] = ai[j] - xi;
+                ar[j] += xr;
+                ai[j] += xi;
+            }
+        }
+    }
+}
+
+/* Window the history, transform it and add each bin's magnitude to its
+ * band in frame[] */
+static inline void kd_lite_spectrum(const kd_lite_tables *t, const kd_lite *s, float *frame) {
+    float re[KD_LITE_HALF], im[KD_LITE_HALF];
+    for (int i = 0; i < KD_LITE_HALF; i++) {
+        re[i] = s->hist[2 * i] * t->window[2 * i];
+        im[i] = s->hist[2 * i + 1] * t->window[2 * i + 1];
+    }
+    kd_lite_fft(t, re, im);
+
+    /* X[k] = (Z[k] + conj Z[M-k]) / 2 - i w^k (Z[k] - conj Z[M-k]) / 2 */
+    for (int k = 1; k <= KD_LITE_HALF; k++) {
+        int band = t->bin_band[k];
+        if (band < 0) continue;
+        int a = k & (KD_LITE_HALF - 1), b = (KD_LITE_HALF - k) & (KD_LITE_HALF - 1);
+        float er = 0.5f * (re[a] + re[b]), ei = 0.5f * (im[a] - im[b]);
+        float or_ = 0.5f * (im[a] + im[b]), oi = -0.5f * (re[a] - re[b]);
+        float xr = er + t->post_re[k] * or_ - t->post_im[k] * oi;
+        float xi = ei + t->post_re[k] * oi + t->post_im[k] * or_;
+        frame[band] += std::sqrt(xr * xr + xi * xi);
+    }
+}
+
+/* Push n samples.  Every KD_LITE_HOP samples, once the history is full,
+ * the spectrum of the newest KD_LITE_FFT samples is added into frame[]
+ * (which the caller zeroes per output frame).  Returns the number of FFT
+ * frames added. */
+static inline int kd_lite_process(const kd_lite_tables *t, kd_lite *s, const float *in, int n,
+                                  float *frame) {
+    int added = 0;
+    while (n > 0) {
+        int take = KD_LITE_HOP - s->since;
+        if (take > n) take = n;
+        std::memmove(s->hist, s->hist + take, (KD_LITE_FFT - take) * sizeof(float));
+        std::memcpy(s->hist + KD_LITE_FFT - take, in, take * sizeof(float));
+        s->filled = s->filled + take > KD_LITE_FFT ? KD_LITE_FFT : s->filled + take;
+        s->since += take;
+        in += take;
+        n -= take;
+
+        if (s->since == KD_LITE_HOP) {
+            s->since = 0;
+            if (s->filled == KD_LITE_FFT) {
+                kd_lite_spectrum(t, s, frame);
+                added++;
+            }
+        }
+    }
+    return added;
+}
+
+/* Classify summed bands (any count that's a multiple of 12, band 0 = A)
+ * against the profile: the key whose rotated profile best correlates with
+ * the pitch-class sum.  Returns KD_LITE_SILENCE for an empty vector. */
+static inline int kd_lite_classify(const kd_lite_tables *t, const double *bands, int n_bands,
+                                   int profile) {
+    double pc[12] = {};
+    double total = 0.0;
+    for (int b = 0; b < n_bands; b++) {
+        pc[b % 12] += bands[b];
+        total += bands[b];
+    }
+    if (!(total > 1e-9)) return KD_LITE_SILENCE;
+
+    /* Profiles are zero-mean, so a plain dot product ranks keys exactly
+     * as Pearson correlation does */
+    int best = KD_LITE_SILENCE;
+    double best_r = -1e300;
+    for (int tonic = 0; tonic < 12; tonic++) {
+        for (int mode = 0; mode < 2; mode++) {
+            const float *p = t->profiles[profile][mode];
+            double r = 0.0;
+            for (int d = 0; d < 12; d++) r += p[d] * pc[(tonic + d) % 12];
+            if (r > best_r) {
+                best_r = r;
+                best = tonic * 2 + mode;
+            }
+        }
+    }
+    return best;
+}
+
+#endif /* KD_LITE_H */
@@ -0,0 +1,417 @@
+/*
+ * kd_resampler.h - Anti-aliased resampling front end for the key detector
+ *
+ * Converts any input rate to the fixed analysis rate.  The implementation
+ * is picked once from the rate pair:
+ *   - equal rates:      passthrough
+ *   - integer ratio:    polyphase FIR decimator, evaluated only at the
+ *                       output instants we keep (TAPS MACs per output)
+ *   - anything else:    rational L/M polyphase resampler
+ * kd_decimator_process_fixed is the decimator with factor and block size
+ * fixed at compile time, for hosts with a known block.
+ * The dot product and the stereo int16 downmix in front of it have NEON
+ * (Move), AVX(2) / SSE(2) (x86 batch boxes) inner loops and scalar
+ * fallbacks.
+ *
+ * Header-only so it can be reused by the offline tools.  Only
+ * kd_resampler_init / kd_resampler_free allocate; processing never does.
+ */
+
+#ifndef KD_RESAMPLER_H
+#define KD_RESAMPLER_H
+
+#include <cmath>
+#include <cstring>
+#include <new>
+
+#include <stdint.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define KD_SIMD_NEON 1
+#elif defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#if defined(__AVX__)
+#define KD_SIMD_AVX 1
+#else
+#define KD_SIMD_SSE 1
+#endif
+#if defined(__AVX2__)
+#define KD_SIMD_AVX2 1
+#elif defined(__SSE2__)
+#define KD_SIMD_SSE2 1
+#endif
+#endif
+
+/* Taps per output phase.  12 taps/phase with a Blackman window gives
+ * ~74 dB stopband from 0.68 * output rate upward, i.e. nothing that would
+ * fold back under 3.5 kHz (the top of libkeyfinder's chroma range). */
+#define KD_DECIM_TAPS_PER_PHASE 12
+#define KD_DECIM_MAX_FACTOR 8
+#define KD_DECIM_MAX_TAPS (KD_DECIM_TAPS_PER_PHASE * KD_DECIM_MAX_FACTOR)
+
+/* Dot product of two float vectors, n a multiple of 8. */
+static inline float kd_dot(const float *a, const float *b, int n) {
+#if defined(KD_SIMD_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (int i = 0; i < n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i),     vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+#if defined(__aarch64__)
+    return vaddvq_f32(acc);
+#else
+    float32x2_t s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+#endif
+#elif defined(KD_SIMD_AVX)
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                               _mm256_loadu_ps(b + i)));
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+#elif defined(KD_SIMD_SSE)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i),     _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 s = _mm_add_ps(acc0, acc1);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+#else
+    float acc = 0.0f;
+    for (int i = 0; i < n; i++) acc += a[i] * b[i];
+    return acc;
+#endif
+}
+
+/* ---- Stereo int16 -> mono float downmix, (L + R) / 65536 ---- */
+
+#define KD_DOWNMIX_SCALE (0.5f / 32768.0f)
+
+static inline void kd_downmix_s16_scalar(const int16_t *stereo, int frames, float *mono) {
+    for (int i = 0; i < frames; i++) {
+        mono[i] = (float)(stereo[i * 2] + stereo[i * 2 + 1]) * KD_DOWNMIX_SCALE;
+    }
+}
+
+static inline void kd_downmix_s16(const int16_t *stereo, int frames, float *mono) {
+    int i = 0;
+#if defined(KD_SIMD_NEON)
+    /* Pairwise widening add of interleaved L/R gives L+R per frame */
+    const float32x4_t scale = vdupq_n_f32(KD_DOWNMIX_SCALE);
+    for (; i + 8 <= frames; i += 8) {
+        int32x4_t lo = vpaddlq_s16(vld1q_s16(stereo + i * 2));
+        int32x4_t hi = vpaddlq_s16(vld1q_s16(stereo + i * 2 + 8));
+        vst1q_f32(mono + i,     vmulq_f32(vcvtq_f32_s32(lo), scale));
+        vst1q_f32(mono + i + 4, vmulq_f32(vcvtq_f32_s32(hi), scale));
+    }
+#elif defined(KD_SIMD_AVX2)
+    /* madd against 1s sums each adjacent L/R pair into an int32 */
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256 scale = _mm256_set1_ps(KD_DOWNMIX_SCALE);
+    for (; i + 8 <= frames; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(stereo + i * 2));
+        __m256i sum = _mm256_madd_epi16(v, ones);
+        _mm256_storeu_ps(mono + i, _mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+    }
+#elif defined(KD_SIMD_SSE2)
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128 scale = _mm_set1_ps(KD_DOWNMIX_SCALE);
+    for (; i + 4 <= frames; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(stereo + i * 2));
+        __m128i sum = _mm_madd_epi16(v, ones);
+        _mm_storeu_ps(mono + i, _mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+    }
+#endif
+    kd_downmix_s16_scalar(stereo + i * 2, frames - i, mono + i);
+}
+
+/* Fill h[0..taps) with a unity-DC-gain Blackman-windowed sinc low-pass.
+ * cutoff is in cycles per input sample (0 < cutoff < 0.5). */
+static inline void kd_design_lowpass(float *h, int taps, double cutoff) {
+    const double pi = 3.14159265358979323846;
+    double center = (taps - 1) * 0.5;
+    double sum = 0.0;
+    for (int i = 0; i < taps; i++) {
+        double x = i - center;
+        double sinc = (x == 0.0) ? 2.0 * cutoff
+                                 : std::sin(2.0 * pi * cutoff * x) / (pi * x);
+        double w = 0.42 - 0.5 * std::cos(2.0 * pi * i / (taps - 1))
+                        + 0.08 * std::cos(4.0 * pi * i / (taps - 1));
+        h[i] = (float)(sinc * w);
+        sum += h[i];
+    }
+    for (int i = 0; i < taps; i++) h[i] = (float)(h[i] / sum);
+}
+
+/* ---- Integer-factor polyphase decimator ---- */
+
+#define KD_DECIM_BLOCK 256               /* inputs appended to the history per pass */
+
+struct kd_decimator {
+    int factor;                          /* input samples per output sample */
+    int taps;                            /* factor * KD_DECIM_TAPS_PER_PHASE, rounded up to 8 */
+    int phase;                           /* inputs to pass before the next output */
+    float coefs[KD_DECIM_MAX_TAPS];
+    /* Linear history: the last taps-1 inputs, then the block being
+     * processed.  Every output window is contiguous, so a block is a
+     * strided run of dot products with no per-sample bookkeeping. */
+    float buf[KD_DECIM_MAX_TAPS + KD_DECIM_BLOCK];
+};
+
+static inline void kd_decimator_init(kd_decimator *d, int factor) {
+    if (factor < 1) factor = 1;
+    if (factor > KD_DECIM_MAX_FACTOR) factor = KD_DECIM_MAX_FACTOR;
+    d->factor = factor;
+    d->taps = (factor * KD_DECIM_TAPS_PER_PHASE + 7) & ~7;
+    d->phase = 0;
+    std::memset(d->buf, 0, sizeof(d->buf));
+    /* Cut off at 90% of the output Nyquist frequency */
+    kd_design_lowpass(d->coefs, d->taps, 0.45 / factor);
+}
+
+static inline void kd_decimator_reset(kd_decimator *d) {
+    d->phase = 0;
+    std::memset(d->buf, 0, sizeof(d->buf));
+}
+
+/* Push n input samples, write decimated samples to out.
+ * Returns number of output samples written (at most n / factor + 1). */
+static inline int kd_decimator_process(kd_decimator *d, const float *in, int n, float *out) {
+    const int taps = d->taps;
+    const int keep = taps - 1;
+    int phase = d->phase;
+    int produced = 0;
+
+    while (n > 0) {
+        int m = n < KD_DECIM_BLOCK ? n : KD_DECIM_BLOCK;
+        std::memcpy(d->buf + keep, in, m * sizeof(float));
+        int total = keep + m;
+
+        /* Output for the input at buf[e] uses buf[e - keep .. e].  The
+         * filter is symmetric, so oldest-to-newest order needs no flip. */
+        int e = keep + phase;
+        for (; e < total; e += d->factor) {
+            out[produced++] = kd_dot(d->buf + e - keep, d->coefs, taps);
+        }
+        phase = e - total;
+
+        std::memmove(d->buf, d->buf + m, keep * sizeof(float));
+        in += m;
+        n -= m;
+    }
+
+    d->phase = phase;
+    return produced;
+}
+
+/* ---- Compile-time specialised decimator ---- */
+
+/* kd_design_lowpass for kd_decimator_init(FACTOR): one table per factor,
+ * built during static initialisation, so the audio thread never designs
+ * it and the hot loop reads it with no first-use guard. */
+template <int FACTOR>
+struct kd_fixed_lowpass {
+    static const int TAPS = (FACTOR * KD_DECIM_TAPS_PER_PHASE + 7) & ~7;
+    float h[TAPS];
+
+    kd_fixed_lowpass() { kd_design_lowpass(h, TAPS, 0.45 / FACTOR); }
+
+    static const kd_fixed_lowpass table;
+};
+
+template <int FACTOR>
+const kd_fixed_lowpass<FACTOR> kd_fixed_lowpass<FACTOR>::table;
+
+/* kd_decimator_process for exactly BLOCK inputs, with the factor, tap
+ * count fixed at compile time: no block splitting or phase tracking, a
+ * constant output count, and dot products of a known length over a
+ * static table, which the compiler unrolls in full.
+ * Works on a kd_decimator's own history, so it mixes freely with
+ * kd_decimator_process; requires d->factor == FACTOR and d->phase == 0,
+ * which any run of whole BLOCK-sized calls preserves.  Writes BLOCK /
+ * FACTOR outputs. */
+template <int FACTOR, int BLOCK>
+static inline void kd_decimator_process_fixed(kd_decimator *d, const float *in, float *out) {
+    constexpr int taps = kd_fixed_lowpass<FACTOR>::TAPS;
+    constexpr int keep = taps - 1;
+    static_assert(BLOCK % FACTOR == 0, "block must be whole output periods");
+    static_assert(BLOCK <= KD_DECIM_BLOCK && taps <= KD_DECIM_MAX_TAPS, "fits kd_decimator");
+    const float *coefs = kd_fixed_lowpass<FACTOR>::table.h;
+
+    std::memcpy(d->buf + keep, in, BLOCK * sizeof(float));
+    for (int o = 0; o < BLOCK / FACTOR; o++) {
+        out[o] = kd_dot(d->buf + o * FACTOR, coefs, taps);
+    }
+    std::memmove(d->buf, d->buf + BLOCK, keep * sizeof(float));
+}
+
+/* ---- Rational L/M polyphase resampler ---- */
+
+struct kd_polyphase {
+    int up;                              /* L: interpolation factor */
+    int down;                            /* M: decimation factor */
+    int taps;                            /* taps per phase, multiple of 8 */
+    int phase_acc;                       /* upsampled-time offset of next output vs newest input */
+    int hist_pos;
+    float *phases;                       /* up * taps, each phase stored oldest-to-newest */
+    float *hist;                         /* 2 * taps, same double-write layout as kd_decimator */
+};
+
+static inline int kd_gcd(int a, int b) {
+    while (b) { int t = a % b; a = b; b = t; }
+    return a;
+}
+
+static inline void kd_polyphase_reset(kd_polyphase *p) {
+    p->phase_acc = p->up;                /* first output lands on the first input */
+    p->hist_pos = 0;
+    std::memset(p->hist, 0, 2 * p->taps * sizeof(float));
+}
+
+static inline void kd_polyphase_free(kd_polyphase *p) {
+    delete[] p->phases;
+    delete[] p->hist;
+    p->phases = NULL;
+    p->hist = NULL;
+}
+
+static inline bool kd_polyphase_init(kd_polyphase *p, int in_rate, int out_rate) {
+    int g = kd_gcd(in_rate, out_rate);
+    p->up = out_rate / g;
+    p->down = in_rate / g;
+
+    /* Keep the transition band the same width (in output-rate terms) as
+     * the integer decimator: 12 input taps per output period. */
+    double ratio = (double)in_rate / out_rate;
+    if (ratio < 1.0) ratio = 1.0;
+    int taps = (int)std::ceil(KD_DECIM_TAPS_PER_PHASE * ratio);
+    p->taps = (taps + 7) & ~7;
+
+    int proto_len = p->up * p->taps;
+    float *proto = new (std::nothrow) float[proto_len];
+    p->phases = new (std::nothrow) float[proto_len];
+    p->hist = new (std::nothrow) float[2 * p->taps];
+    if (!proto || !p->phases || !p->hist) {
+        delete[] proto;
+        kd_polyphase_free(p);
+        return false;
+    }
+
+    /* Prototype runs at in_rate * L; cut at 90% of the lower Nyquist */
+    int min_rate = in_rate < out_rate ? in_rate : out_rate;
+    kd_design_lowpass(proto, proto_len, 0.45 * min_rate / ((double)in_rate * p->up));
+
+    /* Phase ph uses proto[k * L + ph] against x[newest - k]; store it
+     * reversed so it lines up with the oldest-to-newest history window.
+     * Scale by L to restore unity gain after zero-stuffing. */
+    for (int ph = 0; ph < p->up; ph++) {
+        for (int j = 0; j < p->taps; j++) {
+            int k = p->taps - 1 - j;
+            p->phases[ph * p->taps + j] = proto[k * p->up + ph] * (float)p->up;
+        }
+    }
+    delete[] proto;
+
+    kd_polyphase_reset(p);
+    return true;
+}
+
+static inline int kd_polyphase_process(kd_polyphase *p, const float *in, int n, float *out) {
+    const int taps = p->taps;
+    int pos = p->hist_pos;
+    int acc = p->phase_acc;
+    int produced = 0;
+
+    for (int i = 0; i < n; i++) {
+        p->hist[pos] = in[i];
+        p->hist[pos + taps] = in[i];
+        if (++pos == taps) pos = 0;
+
+        /* Emit every output whose upsampled time falls on this input */
+        acc -= p->up;
+        while (acc < p->up) {
+            out[produced++] = kd_dot(p->hist + pos, p->phases + acc * taps, taps);
+            acc += p->down;
+        }
+    }
+
+    p->hist_pos = pos;
+    p->phase_acc = acc;
+    return produced;
+}
+
+/* ---- Front end: picks the cheapest converter for the rate pair ---- */
+
+enum kd_resampler_kind {
+    KD_RESAMPLE_PASSTHROUGH = 0,
+    KD_RESAMPLE_DECIMATE,
+    KD_RESAMPLE_POLYPHASE
+};
+
+struct kd_resampler {
+    int kind;
+    int in_rate;
+    int out_rate;
+    kd_decimator decim;
+    kd_polyphase poly;
+};
+
+/* Upper bound on outputs produced by kd_resampler_process for n inputs. */
+static inline int kd_resampler_max_output(const kd_resampler *r, int n) {
+    if (r->kind == KD_RESAMPLE_PASSTHROUGH) return n;
+    if (r->kind == KD_RESAMPLE_DECIMATE) return n / r->decim.factor + 1;
+    return (int)(((long long)n * r->poly.up) / r->poly.down) + 1;
+}
+
+static inline bool kd_resampler_init(kd_resampler *r, int in_rate, int out_rate) {
+    std::memset(r, 0, sizeof(*r));
+    if (in_rate <= 0 || out_rate <= 0) return false;
+
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+
+    if (in_rate == out_rate) {
+        r->kind = KD_RESAMPLE_PASSTHROUGH;
+    } else if (in_rate % out_rate == 0 && in_rate / out_rate <= KD_DECIM_MAX_FACTOR) {
+        r->kind = KD_RESAMPLE_DECIMATE;
+        kd_decimator_init(&r->decim, in_rate / out_rate);
+    } else {
+        r->kind = KD_RESAMPLE_POLYPHASE;
+        if (!kd_polyphase_init(&r->poly, in_rate, out_rate)) return false;
+    }
+    return true;
+}
+
+static inline void kd_resampler_free(kd_resampler *r) {
+    if (r->kind == KD_RESAMPLE_POLYPHASE) kd_polyphase_free(&r->poly);
+}
+
+static inline void kd_resampler_reset(kd_resampler *r) {
+    if (r->kind == KD_RESAMPLE_DECIMATE) kd_decimator_reset(&r->decim);
+    else if (r->kind == KD_RESAMPLE_POLYPHASE) kd_polyphase_reset(&r->poly);
+}
+
+static inline int kd_resampler_process(kd_resampler *r, const float *in, int n, float *out) {
+    switch (r->kind) {
+    case KD_RESAMPLE_DECIMATE:
+        return kd_decimator_process(&r->decim, in, n, out);
+    case KD_RESAMPLE_POLYPHASE:
+        return kd_polyphase_process(&r->poly, in, n, out);
+    default:
+        std::memcpy(out, in, n * sizeof(float));
+        return n;
+    }
+}
+
+#endif /* KD_RESAMPLER_H */
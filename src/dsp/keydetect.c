@@ -3,15 +3,33 @@
  *
  * A transparent audio FX that detects the musical key of audio passing
  * through it using libkeyfinder. Audio is passed through unmodified.
+ * Key changes can also go out as MIDI CCs on the host's internal bus, so
+ * downstream modules (scale quantizers) follow the key without polling.
  */
 
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "audio_fx_api_v2.h"
 #include "keyfinder_wrapper.h"
 
+/* MIDI clock: 24 ticks per quarter note, bars assumed 4/4 */
+#define MIDI_TICKS_PER_BAR 96
+#define MIDI_TICKS_WRAP (MIDI_TICKS_PER_BAR * 4)   /* all sync lengths divide 4 bars */
+
+/* Key change output: on each change of the detected key, CC KEY_CC_CONFIDENCE
+ * (confidence 0 - 1 as 0 - 127) then CC KEY_CC_INDEX (key index 0 - 23,
+ * kd_key_name order), both on the key_out_channel.  20 and 21 are
+ * undefined in the MIDI spec, so nothing downstream treats them as
+ * anything else. */
+#define KEY_CC_INDEX      20
+#define KEY_CC_CONFIDENCE 21
+#define USB_MIDI_CIN_CC   0x0B
+
 static const host_api_v1_t *g_host = NULL;
 static audio_fx_api_v2_t g_fx_api_v2;
 
@@ -21,8 +39,19 @@ static audio_fx_api_v2_t g_fx_api_v2;
 
 typedef struct {
     void *kd;                   /* keyfinder wrapper context */
-    char detected_key[16];      /* cached key string */
     float window;               /* analysis window in seconds */
+    float hop;                  /* seconds between key estimates */
+    float gate;                 /* silence gate threshold in dBFS */
+    float cpu_budget;           /* analysis CPU cap, percent of one core */
+    int sync_bars;              /* estimate every N bars of MIDI clock (0 = off) */
+    int engine;                 /* KD_ENGINE_* */
+    int clock_ticks;            /* ticks since the last downbeat we know of, mod MIDI_TICKS_WRAP */
+    int clock_stopped;          /* transport stopped; clocks ignored until start/continue */
+    float stats_log;            /* seconds between stats log lines (0 = off) */
+    int key_out;                /* send key changes as MIDI CCs */
+    int key_out_channel;        /* MIDI channel for them, 1 - 16 */
+    uint32_t key_change_sent;   /* kd_key_change.seq last sent, 0 = none */
+    char share[32];             /* share group name ("" = analyse alone) */
     char module_dir[512];
 } keydetect_instance_t;
 
@@ -36,18 +65,25 @@ static void* v2_create_instance(const char *module_dir, const char *config_json)
 
     if (module_dir) {
         strncpy(inst->module_dir, module_dir, sizeof(inst->module_dir) - 1);
+        kd_set_cache_dir(module_dir);   /* FFTW wisdom, if built in */
     }
 
     inst->window = 4.0f;
-    strcpy(inst->detected_key, "---");
+    inst->hop = 1.0f;
+    inst->gate = -60.0f;
+    inst->cpu_budget = 100.0f;
+    inst->key_out_channel = 16;
 
-    inst->kd = kd_create(MOVE_SAMPLE_RATE);
+    inst->kd = kd_create_ex(MOVE_SAMPLE_RATE, MOVE_FRAMES_PER_BLOCK);
     if (!inst->kd) {
         free(inst);
         return NULL;
     }
 
     kd_set_window(inst->kd, inst->window);
+    kd_set_hop(inst->kd, inst->hop);
+    kd_set_gate(inst->kd, inst->gate);
+    kd_set_cpu_budget(inst->kd, inst->cpu_budget);
 
     if (g_host && g_host->log) {
         g_host->log("[keydetect] instance created");
@@ -70,6 +106,24 @@ static void v2_destroy_instance(void *instance) {
 /* Audio processing                                                    */
 /* ------------------------------------------------------------------ */
 
+/* Send the newest key change as CCs.  Receivers only need the current
+ * key, so changes that landed within one block collapse into the last. */
+static void send_key_change(keydetect_instance_t *inst, uint32_t newest) {
+    kd_key_change c;
+    if (kd_get_key_changes(inst->kd, newest - 1, &c, 1) != 1) return;  /* retry next block */
+    inst->key_change_sent = newest;
+    if (!g_host || !g_host->midi_send_internal) return;
+
+    uint8_t status = (uint8_t)(0xB0 | (inst->key_out_channel - 1));
+    int confidence = (int)(c.confidence * 127.0f + 0.5f);
+    if (confidence < 0) confidence = 0;
+    if (confidence > 127) confidence = 127;
+    const uint8_t conf_msg[4] = { USB_MIDI_CIN_CC, status, KEY_CC_CONFIDENCE, (uint8_t)confidence };
+    const uint8_t key_msg[4] = { USB_MIDI_CIN_CC, status, KEY_CC_INDEX, (uint8_t)c.key };
+    g_host->midi_send_internal(conf_msg, 4);
+    g_host->midi_send_internal(key_msg, 4);
+}
+
 static void v2_process_block(void *instance, int16_t *audio_inout, int frames) {
     keydetect_instance_t *inst = (keydetect_instance_t*)instance;
     if (!inst || !inst->kd || !audio_inout || frames <= 0) return;
@@ -78,14 +132,121 @@ static void v2_process_block(void *instance, int16_t *audio_inout, int frames) {
      * We do NOT modify audio_inout — this is a transparent tap. */
     kd_feed(inst->kd, audio_inout, frames);
 
-    /* Cache the detected key */
-    kd_get_key(inst->kd, inst->detected_key, sizeof(inst->detected_key));
+    /* Send key changes only when one has been logged */
+    if (inst->key_out) {
+        uint32_t newest = kd_get_key_change_seq(inst->kd);
+        if (newest != inst->key_change_sent) send_key_change(inst, newest);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* MIDI clock                                                          */
+/* ------------------------------------------------------------------ */
+
+static void v2_on_midi(void *instance, const uint8_t *msg, int len, int source) {
+    keydetect_instance_t *inst = (keydetect_instance_t*)instance;
+    if (!inst || !inst->kd || !msg || len < 1) return;
+    if (source != MOVE_MIDI_SOURCE_HOST && source != MOVE_MIDI_SOURCE_FX_BROADCAST) return;
+
+    /* Clocks count from the first one seen, so an instance loaded while
+     * the transport is already running still syncs; its bar phase is a
+     * guess until the next start or song position pointer fixes it. */
+    switch (msg[0]) {
+    case 0xFA:  /* start: the next clock is the first downbeat */
+        inst->clock_ticks = 0;
+        inst->clock_stopped = 0;
+        break;
+    case 0xFB:  /* continue */
+        inst->clock_stopped = 0;
+        break;
+    case 0xFC:  /* stop */
+        inst->clock_stopped = 1;
+        break;
+    case 0xF2:  /* song position pointer: sixteenths (6 clocks each) from the top */
+        if (len < 3) break;
+        inst->clock_ticks = (((msg[2] & 0x7F) << 7 | (msg[1] & 0x7F)) * 6) % MIDI_TICKS_WRAP;
+        break;
+    case 0xF8:  /* clock */
+        if (inst->clock_stopped) break;
+        /* Estimate on bar lines so windows don't split chord changes */
+        if (inst->sync_bars > 0 &&
+            inst->clock_ticks % (MIDI_TICKS_PER_BAR * inst->sync_bars) == 0) {
+            kd_sync_boundary(inst->kd);
+        }
+        inst->clock_ticks = (inst->clock_ticks + 1) % MIDI_TICKS_WRAP;
+        break;
+    default:
+        break;
+    }
 }
 
 /* ------------------------------------------------------------------ */
 /* Parameters                                                          */
 /* ------------------------------------------------------------------ */
 
+/* Engine names, indexed by KD_ENGINE_* */
+static const char *ENGINE_NAMES[] = { "keyfinder", "krumhansl", "temperley" };
+
+/* Select the engine by name or index; anything else is ignored */
+static void set_engine(keydetect_instance_t *inst, const char *val) {
+    int engine = -1;
+    for (int i = 0; i < 3; i++) {
+        if (strncmp(val, ENGINE_NAMES[i], strlen(ENGINE_NAMES[i])) == 0) engine = i;
+    }
+    if (engine < 0 && val[0] >= '0' && val[0] <= '2') engine = val[0] - '0';
+    if (engine < 0) return;
+    inst->engine = engine;
+    kd_set_engine(inst->kd, engine);
+}
+
+/* Set the share group from a name, keeping only [A-Za-z0-9_-] */
+static void set_share(keydetect_instance_t *inst, const char *name, int len) {
+    int n = 0;
+    for (int i = 0; i < len && name[i] && n < (int)sizeof(inst->share) - 1; i++) {
+        char c = name[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '_' || c == '-') {
+            inst->share[n++] = c;
+        }
+    }
+    inst->share[n] = '\0';
+    if (kd_set_share_group(inst->kd, inst->share) != 0) inst->share[0] = '\0';
+}
+
+/* Turning the output on sends the current key straight away */
+static void set_key_out(keydetect_instance_t *inst, int on) {
+    if (on && !inst->key_out) inst->key_change_sent = 0;
+    inst->key_out = on;
+}
+
+static void set_key_out_channel(keydetect_instance_t *inst, int channel) {
+    if (channel >= 1 && channel <= 16) inst->key_out_channel = channel;
+}
+
+/* Recent key changes as a JSON array, oldest first:
+ * [{"seq":n,"key":"C maj","index":6,"confidence":0.71,"age_ms":1234},...] */
+static int format_key_changes(keydetect_instance_t *inst, char *buf, int buf_len) {
+    kd_key_change changes[KD_KEY_CHANGES];
+    int n = kd_get_key_changes(inst->kd, 0, changes, KD_KEY_CHANGES);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+
+    int len = snprintf(buf, buf_len, "[");
+    for (int i = 0; i < n && len < buf_len; i++) {
+        const kd_key_change *c = &changes[i];
+        double age_ms = now >= c->time_ns ? (now - c->time_ns) / 1e6 : 0.0;
+        len += snprintf(buf + len, buf_len - len,
+                        "%s{\"seq\":%u,\"key\":\"%s\",\"index\":%d,\"confidence\":%.2f,"
+                        "\"age_ms\":%.0f}",
+                        i ? "," : "", (unsigned)c->seq, kd_key_name(c->key), c->key,
+                        c->confidence, age_ms);
+    }
+    if (len < buf_len) len += snprintf(buf + len, buf_len - len, "]");
+    return len < buf_len ? len : -1;
+}
+
 static void v2_set_param(void *instance, const char *key, const char *val) {
     keydetect_instance_t *inst = (keydetect_instance_t*)instance;
     if (!inst || !key || !val) return;
@@ -96,9 +257,45 @@ static void v2_set_param(void *instance, const char *key, const char *val) {
         if (w > 8.0f) w = 8.0f;
         inst->window = w;
         kd_set_window(inst->kd, w);
+        inst->hop = kd_get_hop(inst->kd);
+    } else if (strcmp(key, "hop") == 0) {
+        float h = (float)atof(val);
+        if (h < 0.5f) h = 0.5f;
+        if (h > 8.0f) h = 8.0f;
+        kd_set_hop(inst->kd, h);
+        inst->hop = kd_get_hop(inst->kd);
+    } else if (strcmp(key, "gate") == 0) {
+        kd_set_gate(inst->kd, (float)atof(val));
+        inst->gate = kd_get_gate(inst->kd);
+    } else if (strcmp(key, "cpu_budget") == 0) {
+        kd_set_cpu_budget(inst->kd, (float)atof(val));
+        inst->cpu_budget = kd_get_cpu_budget(inst->kd);
+    } else if (strcmp(key, "sync") == 0) {
+        /* "off", or bars per estimate: 1, 2 or 4 */
+        int bars = atoi(val);
+        inst->sync_bars = (bars == 1 || bars == 2 || bars == 4) ? bars : 0;
+    } else if (strcmp(key, "engine") == 0) {
+        /* "keyfinder" (libkeyfinder), or the light "krumhansl"/"temperley" */
+        set_engine(inst, val);
+    } else if (strcmp(key, "reset_global") == 0) {
+        /* Start the session-wide key afresh (any value) */
+        kd_reset_session(inst->kd);
+    } else if (strcmp(key, "share") == 0) {
+        /* Instances with the same name analyse identical audio once */
+        set_share(inst, val, (int)strlen(val));
+    } else if (strcmp(key, "key_out") == 0) {
+        /* "off", or "cc": send key changes as MIDI CCs */
+        set_key_out(inst, strncmp(val, "cc", 2) == 0 || strcmp(val, "1") == 0);
+    } else if (strcmp(key, "key_out_channel") == 0) {
+        set_key_out_channel(inst, atoi(val));
+    } else if (strcmp(key, "stats_log") == 0) {
+        /* Diagnostics: log the stats JSON every N seconds, 0 = off */
+        float secs = (float)atof(val);
+        inst->stats_log = secs > 0.0f ? secs : 0.0f;
+        kd_set_stats_log(inst->kd, g_host ? g_host->log : NULL, inst->stats_log);
     } else if (strcmp(key, "state") == 0) {
-        /* Restore from patch — parse window value from JSON.
-         * Simple parsing: look for "window": <number> */
+        /* Restore from patch — parse window/hop/gate values from JSON.
+         * Simple parsing: look for "window": <number>, "hop": <number> */
         const char *wp = strstr(val, "\"window\":");
         if (wp) {
             wp += 9; /* skip "window": */
@@ -107,8 +304,64 @@ static void v2_set_param(void *instance, const char *key, const char *val) {
             if (w >= 1.0f && w <= 8.0f) {
                 inst->window = w;
                 kd_set_window(inst->kd, w);
+                inst->hop = kd_get_hop(inst->kd);
             }
         }
+        const char *hp = strstr(val, "\"hop\":");
+        if (hp) {
+            hp += 6; /* skip "hop": */
+            while (*hp == ' ') hp++;
+            float h = (float)atof(hp);
+            if (h >= 0.5f && h <= 8.0f) {
+                kd_set_hop(inst->kd, h);
+                inst->hop = kd_get_hop(inst->kd);
+            }
+        }
+        const char *gp = strstr(val, "\"gate\":");
+        if (gp) {
+            gp += 7; /* skip "gate": */
+            while (*gp == ' ') gp++;
+            kd_set_gate(inst->kd, (float)atof(gp));
+            inst->gate = kd_get_gate(inst->kd);
+        }
+        const char *cp = strstr(val, "\"cpu_budget\":");
+        if (cp) {
+            cp += 13; /* skip "cpu_budget": */
+            while (*cp == ' ') cp++;
+            kd_set_cpu_budget(inst->kd, (float)atof(cp));
+            inst->cpu_budget = kd_get_cpu_budget(inst->kd);
+        }
+        const char *sp = strstr(val, "\"sync\":");
+        if (sp) {
+            sp += 7; /* skip "sync": */
+            while (*sp == ' ') sp++;
+            int bars = atoi(sp);
+            inst->sync_bars = (bars == 1 || bars == 2 || bars == 4) ? bars : 0;
+        }
+        const char *ep = strstr(val, "\"engine\":");
+        if (ep) {
+            ep += 9; /* skip "engine": */
+            while (*ep == ' ' || *ep == '"') ep++;
+            set_engine(inst, ep);
+        }
+        const char *kp = strstr(val, "\"key_out\":");
+        if (kp) {
+            kp += 10; /* skip "key_out": */
+            while (*kp == ' ') kp++;
+            set_key_out(inst, atoi(kp) != 0);
+        }
+        const char *kcp = strstr(val, "\"key_out_channel\":");
+        if (kcp) {
+            kcp += 18; /* skip "key_out_channel": */
+            while (*kcp == ' ') kcp++;
+            set_key_out_channel(inst, atoi(kcp));
+        }
+        const char *shp = strstr(val, "\"share\":\"");
+        if (shp) {
+            shp += 9; /* skip "share":" */
+            const char *end = strchr(shp, '"');
+            if (end) set_share(inst, shp, (int)(end - shp));
+        }
     }
 }
 
@@ -119,10 +372,19 @@ static const char *UI_HIERARCHY =
             "\"root\":{"
                 "\"label\":\"KeyDetect\","
                 "\"children\":null,"
-                "\"knobs\":[\"window\"],"
+                "\"knobs\":[\"window\",\"hop\",\"gate\",\"cpu_budget\",\"sync\"],"
                 "\"params\":["
                     "{\"key\":\"detected_key\",\"label\":\"Key\"},"
-                    "{\"key\":\"window\",\"label\":\"Window (s)\"}"
+                    "{\"key\":\"detected_key_fast\",\"label\":\"Key (now)\"},"
+                    "{\"key\":\"detected_key_global\",\"label\":\"Key (session)\"},"
+                    "{\"key\":\"window\",\"label\":\"Window (s)\"},"
+                    "{\"key\":\"hop\",\"label\":\"Hop (s)\"},"
+                    "{\"key\":\"gate\",\"label\":\"Gate (dB)\"},"
+                    "{\"key\":\"cpu_budget\",\"label\":\"CPU (%)\"},"
+                    "{\"key\":\"sync\",\"label\":\"Bar Sync\"},"
+                    "{\"key\":\"engine\",\"label\":\"Engine\"},"
+                    "{\"key\":\"key_out\",\"label\":\"Key Out\"},"
+                    "{\"key\":\"key_out_channel\",\"label\":\"Key Out Ch\"}"
                 "]"
             "}"
         "}"
@@ -131,19 +393,118 @@ static const char *UI_HIERARCHY =
 static const char *CHAIN_PARAMS =
     "["
         "{\"key\":\"window\",\"name\":\"Window\",\"type\":\"float\","
-         "\"min\":1,\"max\":8,\"step\":0.5,\"default\":4,\"unit\":\"s\"}"
+         "\"min\":1,\"max\":8,\"step\":0.5,\"default\":4,\"unit\":\"s\"},"
+        "{\"key\":\"hop\",\"name\":\"Hop\",\"type\":\"float\","
+         "\"min\":0.5,\"max\":8,\"step\":0.5,\"default\":1,\"unit\":\"s\"},"
+        "{\"key\":\"gate\",\"name\":\"Gate\",\"type\":\"float\","
+         "\"min\":-96,\"max\":-20,\"step\":1,\"default\":-60,\"unit\":\"dB\"},"
+        "{\"key\":\"cpu_budget\",\"name\":\"CPU Budget\",\"type\":\"float\","
+         "\"min\":1,\"max\":100,\"step\":1,\"default\":100,\"unit\":\"%\"},"
+        "{\"key\":\"sync\",\"name\":\"Bar Sync\",\"type\":\"enum\","
+         "\"options\":[\"off\",\"1\",\"2\",\"4\"],\"default\":\"off\"},"
+        "{\"key\":\"engine\",\"name\":\"Engine\",\"type\":\"enum\","
+         "\"options\":[\"keyfinder\",\"krumhansl\",\"temperley\"],\"default\":\"keyfinder\"},"
+        "{\"key\":\"key_out\",\"name\":\"Key Out\",\"type\":\"enum\","
+         "\"options\":[\"off\",\"cc\"],\"default\":\"off\"},"
+        "{\"key\":\"key_out_channel\",\"name\":\"Key Out Channel\",\"type\":\"int\","
+         "\"min\":1,\"max\":16,\"step\":1,\"default\":16}"
     "]";
 
 static int v2_get_param(void *instance, const char *key, char *buf, int buf_len) {
     keydetect_instance_t *inst = (keydetect_instance_t*)instance;
     if (!inst || !key || !buf || buf_len <= 0) return -1;
 
+    /* Parameters may be read off the audio thread, so each takes its own
+     * snapshot of the published result */
     if (strcmp(key, "detected_key") == 0) {
-        return snprintf(buf, buf_len, "%s", inst->detected_key);
+        char name[16];
+        kd_get_key(inst->kd, name, sizeof(name));
+        return snprintf(buf, buf_len, "%s", name);
+    } else if (strcmp(key, "detected_key_fast") == 0) {
+        char name[16];
+        kd_get_key_horizon(inst->kd, KD_HORIZON_FAST, name, sizeof(name));
+        return snprintf(buf, buf_len, "%s", name);
+    } else if (strcmp(key, "detected_key_long") == 0) {
+        char name[16];
+        kd_get_key_horizon(inst->kd, KD_HORIZON_LONG, name, sizeof(name));
+        return snprintf(buf, buf_len, "%s", name);
+    } else if (strcmp(key, "detected_key_global") == 0) {
+        char name[16];
+        kd_get_key_horizon(inst->kd, KD_HORIZON_SESSION, name, sizeof(name));
+        return snprintf(buf, buf_len, "%s", name);
+    } else if (strcmp(key, "key_index") == 0) {
+        kd_result r;
+        int k = kd_get_result(inst->kd, &r) ? r.key : -1;
+        return snprintf(buf, buf_len, "%d", k);
+    } else if (strcmp(key, "confidence") == 0) {
+        kd_result r;
+        float c = kd_get_result(inst->kd, &r) ? r.confidence : 0.0f;
+        return snprintf(buf, buf_len, "%.2f", c);
+    } else if (strcmp(key, "key_scores") == 0) {
+        /* JSON array of the 24 vote weights, in kd_key_name order */
+        kd_result r;
+        if (!kd_get_result(inst->kd, &r)) return -1;
+        int len = snprintf(buf, buf_len, "[");
+        for (int k = 0; k < KD_NUM_KEYS && len < buf_len; k++) {
+            len += snprintf(buf + len, buf_len - len, "%s%.3f", k ? "," : "", r.scores[k]);
+        }
+        if (len < buf_len) len += snprintf(buf + len, buf_len - len, "]");
+        return len < buf_len ? len : -1;
     } else if (strcmp(key, "window") == 0) {
         return snprintf(buf, buf_len, "%.1f", inst->window);
+    } else if (strcmp(key, "hop") == 0) {
+        return snprintf(buf, buf_len, "%.1f", inst->hop);
+    } else if (strcmp(key, "gate") == 0) {
+        return snprintf(buf, buf_len, "%.0f", inst->gate);
+    } else if (strcmp(key, "gated") == 0) {
+        return snprintf(buf, buf_len, "%d", kd_is_gated(inst->kd));
+    } else if (strcmp(key, "cpu_budget") == 0) {
+        return snprintf(buf, buf_len, "%.0f", inst->cpu_budget);
+    } else if (strcmp(key, "sync") == 0) {
+        if (inst->sync_bars == 0) return snprintf(buf, buf_len, "off");
+        return snprintf(buf, buf_len, "%d", inst->sync_bars);
+    } else if (strcmp(key, "engine") == 0) {
+        return snprintf(buf, buf_len, "%s", ENGINE_NAMES[inst->engine]);
+    } else if (strcmp(key, "cpu_load") == 0) {
+        float load;
+        kd_get_load(inst->kd, &load, NULL);
+        return snprintf(buf, buf_len, "%.1f", load);
+    } else if (strcmp(key, "analysis_stride") == 0) {
+        int stride;
+        kd_get_load(inst->kd, NULL, &stride);
+        return snprintf(buf, buf_len, "%d", stride);
+    } else if (strcmp(key, "analyzed_windows") == 0) {
+        uint32_t n;
+        kd_get_window_counts(inst->kd, &n, NULL, NULL);
+        return snprintf(buf, buf_len, "%u", (unsigned)n);
+    } else if (strcmp(key, "coalesced_windows") == 0) {
+        uint32_t n;
+        kd_get_window_counts(inst->kd, NULL, &n, NULL);
+        return snprintf(buf, buf_len, "%u", (unsigned)n);
+    } else if (strcmp(key, "dropped_windows") == 0) {
+        uint32_t n;
+        kd_get_window_counts(inst->kd, NULL, NULL, &n);
+        return snprintf(buf, buf_len, "%u", (unsigned)n);
+    } else if (strcmp(key, "key_changes") == 0) {
+        return format_key_changes(inst, buf, buf_len);
+    } else if (strcmp(key, "key_change_seq") == 0) {
+        return snprintf(buf, buf_len, "%u", (unsigned)kd_get_key_change_seq(inst->kd));
+    } else if (strcmp(key, "key_out") == 0) {
+        return snprintf(buf, buf_len, "%s", inst->key_out ? "cc" : "off");
+    } else if (strcmp(key, "key_out_channel") == 0) {
+        return snprintf(buf, buf_len, "%d", inst->key_out_channel);
+    } else if (strcmp(key, "share") == 0) {
+        return snprintf(buf, buf_len, "%s", inst->share);
+    } else if (strcmp(key, "sharing") == 0) {
+        return snprintf(buf, buf_len, "%d", kd_is_following(inst->kd));
+    } else if (strcmp(key, "stats") == 0) {
+        return kd_format_stats(inst->kd, buf, buf_len);
+    } else if (strcmp(key, "stats_log") == 0) {
+        return snprintf(buf, buf_len, "%.0f", inst->stats_log);
     } else if (strcmp(key, "display_name") == 0) {
-        return snprintf(buf, buf_len, "KeyDetect: %s", inst->detected_key);
+        char name[16];
+        kd_get_key(inst->kd, name, sizeof(name));
+        return snprintf(buf, buf_len, "KeyDetect: %s", name);
     } else if (strcmp(key, "ui_hierarchy") == 0) {
         int len = (int)strlen(UI_HIERARCHY);
         if (len < buf_len) {
@@ -159,7 +520,12 @@ static int v2_get_param(void *instance, const char *key, char *buf, int buf_len)
         }
         return -1;
     } else if (strcmp(key, "state") == 0) {
-        return snprintf(buf, buf_len, "{\"window\":%.1f}", inst->window);
+        return snprintf(buf, buf_len, "{\"window\":%.1f,\"hop\":%.1f,\"gate\":%.0f,"
+                        "\"cpu_budget\":%.0f,\"sync\":%d,\"engine\":\"%s\",\"share\":\"%s\","
+                        "\"key_out\":%d,\"key_out_channel\":%d}",
+                        inst->window, inst->hop, inst->gate, inst->cpu_budget,
+                        inst->sync_bars, ENGINE_NAMES[inst->engine], inst->share,
+                        inst->key_out, inst->key_out_channel);
     }
 
     return -1;
@@ -179,7 +545,7 @@ audio_fx_api_v2_t* move_audio_fx_init_v2(const host_api_v1_t *host) {
     g_fx_api_v2.process_block   = v2_process_block;
     g_fx_api_v2.set_param       = v2_set_param;
     g_fx_api_v2.get_param       = v2_get_param;
-    g_fx_api_v2.on_midi         = NULL;
+    g_fx_api_v2.on_midi         = v2_on_midi;
 
     return &g_fx_api_v2;
 }
@@ -1,23 +1,64 @@
 /*
  * keyfinder_wrapper.cpp - C++ wrapper around libkeyfinder
  *
- * Audio thread is completely lock-free with zero-copy handoff (ping-pong).
- * Audio is downsampled 4x before analysis to reduce CPU load.
- * Analysis thread runs at low priority.
+ * Audio thread is completely lock-free: it writes into an SPSC ring and
+ * publishes a hop of audio at a time.
+ * Audio is resampled to 11025 Hz before analysis to reduce CPU load.
+ * Analysis runs on a process-wide pool of low-priority threads shared by
+ * all instances, and builds the chromagram incrementally, one hop of new
+ * audio at a time.
  */
 
 #include "keyfinder_wrapper.h"
+#include "kd_resampler.h"
+#include "kd_lite.h"
 
 #include <keyfinder/keyfinder.h>
 #include <keyfinder/audiodata.h>
+#include <keyfinder/chromagram.h>
+#include <keyfinder/workspace.h>
 #include <keyfinder/constants.h>
 
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <unistd.h>
 #include <sched.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+#if defined(KD_FFTW_WISDOM)
+#include <fftw3.h>
+#endif
+
+/*
+ * Counting semaphore for waking the analysis pool.  Posting never blocks
+ * (sem_post is a single futex wake on Linux), so the audio thread can use
+ * it.  macOS has no unnamed POSIX semaphores; use libdispatch there so the
+ * offline tools still run on a laptop.
+ */
+#if defined(__APPLE__)
+typedef dispatch_semaphore_t kd_sem_t;
+static bool kd_sem_init(kd_sem_t *s) { *s = dispatch_semaphore_create(0); return *s != NULL; }
+static void kd_sem_destroy(kd_sem_t *s) { dispatch_release(*s); }
+static void kd_sem_post(kd_sem_t *s) { dispatch_semaphore_signal(*s); }
+static void kd_sem_wait(kd_sem_t *s) { dispatch_semaphore_wait(*s, DISPATCH_TIME_FOREVER); }
+#else
+typedef sem_t kd_sem_t;
+static bool kd_sem_init(kd_sem_t *s) { return sem_init(s, 0, 0) == 0; }
+static void kd_sem_destroy(kd_sem_t *s) { sem_destroy(s); }
+static void kd_sem_post(kd_sem_t *s) { sem_post(s); }
+static void kd_sem_wait(kd_sem_t *s) { while (sem_wait(s) != 0 && errno == EINTR) {} }
+#endif
 
 /* Key enum to display string mapping */
 static const char* key_names[] = {
@@ -31,126 +72,1677 @@ static const char* key_names[] = {
 };
 
 /*
- * Downsample factor: feed libkeyfinder at ~11025 Hz instead of 44100 Hz.
+ * Analysis rate: feed libkeyfinder at 11025 Hz whatever the input rate.
  * Key detection only needs pitch info up to ~4 kHz, so this is fine.
- * Reduces FFT/analysis CPU by ~4x.
+ * Reduces FFT/analysis CPU by ~4x at 44.1 kHz and ~8x at 96 kHz.
+ * The resampler (kd_resampler.h) is picked from the input rate in
+ * kd_create and removes everything above the new Nyquist first so it
+ * can't alias down into the chroma band.
  */
-#define DOWNSAMPLE 4
-#define EFFECTIVE_RATE (44100 / DOWNSAMPLE)  /* 11025 Hz */
+#define ANALYSIS_RATE 11025
+#define MIN_INPUT_RATE 8000
+#define MAX_INPUT_RATE 384000
 
-/* Max buffer: 8 seconds at downsampled rate, plus headroom for one block */
-#define MAX_BUF_SAMPLES (8 * EFFECTIVE_RATE + 128)
+/*
+ * Streaming chromagram: the audio thread writes resampled float audio into
+ * a ring and publishes it one chroma hop at a time.  The worker turns only
+ * that new audio into chroma frames (libkeyfinder's progressiveChromagram
+ * keeps the FFT overlap in a Workspace) and keeps the most recent frames in
+ * a ring.  Every hop_seconds the key is classified from the ring frames
+ * that cover the last window_seconds, so analysis starts every hop over
+ * the last window and per-update CPU scales with the hop, not the window.
+ * Since the window lives in the chroma ring, the audio ring only has to
+ * cover worker latency.  The light engines (kd_set_engine, kd_lite.h)
+ * make their own frames in the same layout and classify them against key
+ * profiles; the ring, window, horizons and votes are shared.
+ */
+#define CHROMA_HOP ((int)KeyFinder::HOPSIZE)      /* ~0.37 s at ANALYSIS_RATE */
+#define MAX_WINDOW_SECONDS 8
+#define MIN_HOP_SECONDS 0.5f
+/* Audio ring: ~5.9 s of slack for a busy pool (power of two, 256 KB) */
+#define RING_SAMPLES 65536
+#define RING_MASK (RING_SAMPLES - 1)
+#define CHROMA_BANDS 72  /* libkeyfinder: 6 octaves x 12 semitones */
+/*
+ * Key horizons: besides the voted window estimate, each estimate also
+ * classifies the newest chroma frame alone (fast, ~1.5 s of audio), the
+ * last LONG_WINDOW_SECONDS, and a running sum of every frame since the
+ * session started.  All reuse the chroma already computed, so the extra
+ * cost is three classifications per estimate.
+ */
+#define LONG_WINDOW_SECONDS 16
+/* Chroma frames covering the longest horizon (one FFT frame, then one per hop) */
+#define MAX_CHROMA_FRAMES \
+    ((LONG_WINDOW_SECONDS * ANALYSIS_RATE - (int)KeyFinder::FFTFRAMESIZE) / CHROMA_HOP + 1)
 #define NUM_KEYS 25      /* 24 keys + SILENCE */
-#define VOTE_DECAY 0.6f  /* old votes multiplied by this each new analysis */
+#define VOTE_DECAY 0.6f  /* old votes multiplied by this per window of new audio */
+#define FEED_CHUNK 128   /* frames downmixed per resampler call in kd_feed */
+/* kd_create_ex specialises kd_feed for FEED_CHUNK-frame blocks at this
+ * multiple of ANALYSIS_RATE (Move: 128 frames at 44.1 kHz) */
+#define FIXED_FACTOR 4
+/*
+ * Silence gate: kd_feed measures each downmixed chunk and stops passing
+ * audio on once it has been below the threshold for GATE_HOLD_SECONDS, so
+ * muted tracks, gaps between songs and the noise floor cost no resampling
+ * or FFTs and can't pollute the votes (the result just holds).  A chunk
+ * counts as signal if its RMS reaches the threshold, or its peak is
+ * GATE_PEAK_DB above it (sparse plucks with a low average level).
+ */
+#define GATE_DEFAULT_DB -60.0f
+#define GATE_OFF_DB -96.0f    /* at or below this the gate is disabled */
+#define GATE_HOLD_SECONDS 1.0f
+#define GATE_PEAK_DB 20.0f
+/*
+ * Adaptive scheduling.  While estimates keep agreeing with a tally that
+ * leads by STABLE_MARGIN, the worker doubles its chunk stride (up to
+ * MAX_STRIDE), skipping the chroma for the chunks in between; the first
+ * estimate that disagrees drops it straight back to every chunk.  Skipped
+ * chunks never reach the engine, so a libkeyfinder frame made while
+ * striding is spliced from FRAME_CHUNKS chunks `stride` apart and spans
+ * that much more audio; each frame records where its audio really starts
+ * and ends, and a window only counts the frames that lie inside it.  The
+ * stride stops doubling before a frame would outgrow the window, and a
+ * strided window's vote is weighted by the share of a full window's
+ * frames it has.  On top
+ * of that a token bucket, refilled per chunk of audio, caps chroma CPU at
+ * the per-instance budget (a fraction of one core, 1 = uncapped).
+ */
+#define STABLE_MARGIN 0.5f
+#define STABLE_ESTIMATES 4   /* agreeing estimates before the stride doubles */
+#define MAX_STRIDE 4
+#define FRAME_CHUNKS ((int)KeyFinder::FFTFRAMESIZE / CHROMA_HOP)  /* chunks in a libkeyfinder frame */
+#define CHUNK_NS (CHROMA_HOP * 1e9 / ANALYSIS_RATE)
+/* Bar sync: the chroma ring holds LONG_WINDOW_SECONDS, so that is the
+ * longest span between boundaries estimated in full (4 bars down to 60
+ * BPM); a span up to SYNC_TIMEOUT is estimated over its newest frames.
+ * With no boundary for SYNC_SLACK longer than the last span (SYNC_TIMEOUT
+ * until there is one), fall back to the hop schedule. */
+#define SYNC_SLACK (2 * ANALYSIS_RATE)
+#define SYNC_TIMEOUT (LONG_WINDOW_SECONDS * ANALYSIS_RATE + SYNC_SLACK)
+#define RESULT_READ_TRIES 4  /* seqlock read attempts before kd_get_result gives up */
+#define STATS_LINE 1024      /* longest stats log line */
+
+/*
+ * Latency histogram for kd_get_stats, buckets as in the header.  Each has
+ * one writer at a time (the audio thread, or the pool thread holding the
+ * context's slot), so updates are relaxed load/store pairs, no RMWs.
+ */
+struct kd_latency_hist {
+    std::atomic<uint32_t> buckets[KD_HIST_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint32_t> max_ns;
+};
+
+typedef void (*kd_log_fn)(const char *msg);
+
+/*
+ * One entry of a cell's key-change log.  `seq` is the change number it
+ * holds, 0 while being rewritten, so it doubles as the entry's seqlock.
+ */
+struct kd_change_slot {
+    std::atomic<uint32_t> seq;
+    std::atomic<int> key;
+    std::atomic<int> prev_key;
+    std::atomic<float> confidence;
+    std::atomic<uint32_t> result_seq;
+    std::atomic<uint64_t> time_ns;
+};
+
+/*
+ * A published result, as a seqlock: seq is odd while a publish is in
+ * progress and goes up by two per result.  Fields are relaxed atomics so a
+ * reader racing a publish sees torn-but-defined values and simply retries.
+ * Writers claim the odd state with a CAS, so if two ever overlap (a share
+ * group changing leader mid-publish) the second just skips its update.
+ * Every publish that changes the key also appends to the change log, a
+ * ring of the last KD_KEY_CHANGES, under the same claim.
+ */
+struct kd_result_cell {
+    std::atomic<uint32_t> seq;
+    std::atomic<int> key;
+    std::atomic<float> confidence;
+    std::atomic<float> margin;
+    std::atomic<float> scores[KD_NUM_KEYS];
+    std::atomic<int> horizon_keys[KD_NUM_HORIZONS];
+    std::atomic<uint32_t> changes;      /* key changes logged, = newest change's seq */
+    kd_change_slot change_log[KD_KEY_CHANGES];
+};
+
+/*
+ * Shared-input dedup.  Contexts given the same share group name
+ * fingerprint every block they are fed.  One of them, elected by CAS on
+ * `leader`, analyses as usual, pushes its fingerprints into the group and
+ * publishes its results to the group's cell as well as its own.  A member
+ * whose blocks keep matching the leader's recent ones stops resampling
+ * and analysing and reads the group result instead, so N identical taps
+ * cost one pipeline.  If the leader's blocks stop arriving (bypassed,
+ * removed), the next member to notice takes over.  Group slots, like pool
+ * slots, are static, so a stale pointer is never a dangling one.
+ */
+#define SHARE_GROUPS 16
+#define SHARE_NAME_LEN 32
+#define SHARE_HISTORY 8         /* leader fingerprints a member may match */
+#define SHARE_FOLLOW_BLOCKS 16  /* consecutive matches before following */
+#define SHARE_STALL_BLOCKS 8    /* own blocks with no leader block before taking over */
+
+struct kd_context;
+
+struct kd_share_group {
+    char name[SHARE_NAME_LEN];          /* "" = free (g_pool.lock) */
+    int members;                        /* g_pool.lock */
+    std::atomic<kd_context*> leader;    /* compared, never dereferenced, by members */
+    std::atomic<uint64_t> fingerprints[SHARE_HISTORY];
+    std::atomic<uint32_t> blocks;       /* leader blocks fingerprinted */
+    kd_result_cell result;
+};
+
+static kd_share_group g_groups[SHARE_GROUPS];
+
+/*
+ * The large per-instance state: audio and chroma rings plus libkeyfinder's
+ * workspaces, ~300 KB in all.  A context starts without it, so creating
+ * one (a patch load, stepping through presets) costs a slot and a few KB.
+ * The first block that would be analysed asks for it; a pool thread
+ * allocates it and publishes the pointer, and audio fed before it arrives
+ * is dropped.  Followers in a share group never need it.  Once published
+ * it stays put until the context is freed.
+ */
+struct kd_buffers {
+    /* SPSC ring of resampled mono audio (audio thread writes, pool reads) */
+    float ring[RING_SAMPLES];
+
+    /* Everything below belongs to the pool thread holding the slot.
+     * Everything the worker needs per hop is allocated here once and
+     * reused, so steady-state analysis makes no allocations of its own
+     * (libkeyfinder still has a few short-lived internal temporaries). */
+    float chroma[MAX_CHROMA_FRAMES][CHROMA_BANDS]; /* ring of recent chroma frames */
+    uint32_t chroma_start[MAX_CHROMA_FRAMES];      /* ring position each frame's audio starts at */
+    uint32_t chroma_end[MAX_CHROMA_FRAMES];        /* ring position each frame's audio ends at */
+    kd_lite lite;                       /* kd_lite stream state */
+    KeyFinder::Workspace workspace;     /* carries FFT overlap between chunks */
+    KeyFinder::AudioData chunk;         /* pre-sized to CHROMA_HOP, reused for every handoff */
+    KeyFinder::Workspace classify_ws;   /* holds a MAX_CHROMA_FRAMES chromagram for estimates */
+    KeyFinder::Workspace session_ws;    /* one-hop chromagram for the session sum */
+};
 
 struct kd_context {
-    /* Ping-pong buffers: audio thread writes to one, analysis reads the other.
-     * No copy needed — just swap which index is active. */
-    double bufs[2][MAX_BUF_SAMPLES];
-    std::atomic<int> active_buf;       /* 0 or 1: which buf audio thread writes to */
-    int write_pos;                      /* position in active buf (only audio thread touches) */
-    int downsample_counter;             /* counts input frames for decimation */
-
-    /* Handoff flag: set by audio thread, cleared by analysis thread */
-    std::atomic<int> ready_buf;         /* -1 = none ready, 0 or 1 = buf index to analyze */
-    std::atomic<int> ready_len;         /* number of samples in ready buf */
-
-    /* Analysis thread */
-    std::thread worker;
-    std::atomic<bool> shutdown;
+    /* Counters of the audio ring in bufs are free-running sample counts
+     * (unsigned wrap-around is fine); index with & RING_MASK. */
+    std::atomic<kd_buffers*> bufs;      /* NULL until first needed (pool thread writes) */
+    std::atomic<bool> want_bufs;        /* audio thread asks the pool for bufs */
+    uint32_t ring_write;                /* samples written (only audio thread touches) */
+    uint32_t publish_mark;              /* ring_write at last publish (only audio thread touches) */
+    std::atomic<uint32_t> ring_published; /* samples handed to analysis thread */
+    std::atomic<uint32_t> ring_read;    /* samples consumed by analysis thread */
+    kd_resampler resampler;             /* input rate -> ANALYSIS_RATE (only audio thread touches) */
+    bool fixed_feed;                    /* kd_feed may take feed_chunks<true> (see kd_create_ex) */
+
+    /* Backpressure accounting, so a CPU-bound detector is visible.
+     * Each counter has a single writer; readers use relaxed loads. */
+    std::atomic<uint32_t> windows_analyzed;  /* key estimates made (analysis thread) */
+    std::atomic<uint32_t> windows_coalesced; /* hops merged or skipped to catch up (analysis thread) */
+    std::atomic<uint32_t> windows_dropped;   /* hops lost to a full ring (audio thread) */
+    int drop_accum;                     /* dropped samples not yet a full hop (only audio thread touches) */
+
+    /* Silence gate.  Threshold is set by the control thread as a mean
+     * square (0 = gate off); the rest belongs to the audio thread. */
+    std::atomic<float> gate_db;
+    std::atomic<float> gate_power;
+    int gate_hold;                      /* input frames of quiet before the gate closes */
+    int gate_quiet;                     /* input frames since the last loud chunk, <= gate_hold */
+    std::atomic<bool> gated;            /* gate closed (audio thread writes) */
 
-    /* Result: decaying vote across analyzed windows.
-     * Each new analysis decays old votes by VOTE_DECAY, keeping recent
-     * windows dominant so track changes are picked up quickly. */
+    /* Analysis pool hookup (see pool_kick) */
+    int pool_slot;                      /* index in g_pool.slots */
+    /* Analysis state (only the pool thread holding the slot touches) */
+    int hop_accum;                      /* samples analysed since the last estimate */
+
+    /* Adaptive scheduler (pool thread, except where noted) */
+    int stride;                         /* chroma for one chunk in every `stride` */
+    int stride_phase;                   /* chunks since the last analysed one */
+    int stable_estimates;               /* consecutive agreeing estimates */
+    uint32_t kf_fed[FRAME_CHUNKS];      /* ring positions of the last chunks fed to libkeyfinder */
+    int kf_fed_next;                    /* oldest entry of kf_fed, overwritten next */
+    double budget_tokens;               /* CPU ns we may still spend */
+    std::atomic<float> cpu_budget;      /* fraction of one core (control thread writes) */
+    std::atomic<float> cpu_load;        /* smoothed chroma CPU / audio time */
+    std::atomic<int> stride_shown;      /* stride, for kd_get_load */
+
+    /* Chroma ring in bufs (only the pool thread holding the slot touches) */
+    int chroma_head;                    /* next slot to write */
+    int chroma_count;                   /* valid frames, <= MAX_CHROMA_FRAMES */
+    int chroma_bands;                   /* bands per frame reported by libkeyfinder */
+
+    /* Analysis engine (KD_ENGINE_*).  The control thread posts a request;
+     * the pool thread switches at the start of a pass and clears the ring,
+     * since the two engines' chroma don't mix. */
+    std::atomic<int> engine;            /* requested (control thread writes) */
+    int engine_active;                  /* engine the ring holds (pool thread) */
+
+    /* Key horizons (pool thread, except session_reset) */
+    int horizon_keys[KD_NUM_HORIZONS];  /* latest per horizon, published with the result */
+    double session_chroma[CHROMA_BANDS]; /* sum of every frame this session */
+    int session_frames;
+    std::atomic<bool> session_reset;    /* control thread requests a new session */
+
+    /* Bar sync.  sync_request packs a boundary count (high word) and the
+     * ring_write position of the latest boundary; the audio thread is its
+     * only writer.  The rest belongs to the pool thread. */
+    std::atomic<uint64_t> sync_request;
+    uint32_t sync_seen;                 /* boundary count last acted on; 0 = none yet */
+    uint32_t sync_mark;                 /* ring position of that boundary */
+    int sync_span;                      /* samples between the last two, 0 = not yet */
+    int sync_since;                     /* samples analysed since it, <= SYNC_TIMEOUT */
+
+    /* Result: decaying vote across key estimates.
+     * Votes decay by VOTE_DECAY per window's worth of new audio, keeping
+     * recent estimates dominant so track changes are picked up quickly. */
     float votes[NUM_KEYS];              /* vote tally per key (only analysis thread writes) */
-    char detected_key[16];              /* winning key string (updated by analysis thread) */
 
-    /* Config */
+    /* Published result; the analysis thread is its only writer */
+    kd_result_cell result;
+
+    /* Share group (kd_set_share_group).  The control thread sets `share`;
+     * the rest belongs to the audio thread, except `following`, which
+     * readers use to pick the result cell. */
+    std::atomic<kd_share_group*> share;
+    uint64_t share_fp;                  /* fingerprint of the last block fed */
+    uint32_t share_blocks_seen;         /* group->blocks at the last check */
+    int share_stall;                    /* own blocks since group->blocks moved */
+    int share_matches;                  /* consecutive blocks matching the leader */
+    std::atomic<bool> following;
+
+    /* Instrumentation (kd_get_stats).  Times are CLOCK_MONOTONIC ns, 0 = never. */
+    kd_latency_hist feed_latency;       /* audio thread */
+    kd_latency_hist chroma_latency;     /* pool thread */
+    kd_latency_hist estimate_latency;   /* pool thread */
+    std::atomic<uint64_t> result_time;  /* last publish (pool thread writes) */
+    std::atomic<uint64_t> key_time;     /* last change of published key (pool thread writes) */
+    std::atomic<kd_log_fn> stats_log;   /* control thread writes */
+    std::atomic<float> stats_log_interval;
+    uint64_t stats_logged;              /* last stats log line (pool thread) */
+
+    /* Config.  kd_set_window/kd_set_hop run on the control thread and only
+     * post a request; the audio thread picks it up at the start of its next
+     * kd_feed and hands it on to the worker, so neither thread ever sees a
+     * half-applied change.  Requests pack window/hop samples (see
+     * pack_config) into one word. */
     int sample_rate;
-    float window_seconds;
-    int window_samples;                 /* at downsampled rate */
+    std::atomic<float> window_seconds;  /* as requested (control thread writes) */
+    std::atomic<float> hop_seconds;     /* as requested (control thread writes) */
+    std::atomic<uint64_t> config_request; /* control thread -> audio thread */
+    uint64_t config_fed;                /* last request taken up (only audio thread touches) */
+    int feed_hop_samples;               /* hop for drop accounting (only audio thread touches) */
+    std::atomic<uint64_t> config_active; /* audio thread -> analysis thread */
+    uint64_t config_applied;            /* last config applied by the worker (pool thread) */
+    int window_samples;                 /* at ANALYSIS_RATE (pool thread) */
+    int hop_samples;                    /* at ANALYSIS_RATE (pool thread) */
 };
 
-static void analysis_thread_fn(kd_context *ctx) {
-    /* Set low priority so we don't compete with audio */
-    nice(10);
+/*
+ * Analysis thread scheduling (kd_set_scheduling).  The control thread
+ * writes the settings and bumps `gen`; each pool thread re-applies policy
+ * and affinity to itself when it next wakes and sees a new gen.
+ */
+struct kd_sched {
+    std::atomic<int> policy;            /* KD_SCHED_* */
+    std::atomic<uint64_t> cpu_mask;     /* 0 = any CPU */
+    std::atomic<int> slice_us;          /* 0 = no cooperative yields */
+    std::atomic<uint32_t> gen;
+    std::atomic<uint32_t> max_run_us;   /* longest run between yields since last read */
+};
+
+static kd_sched g_sched;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    KeyFinder::KeyFinder keyfinder;
+static void latency_add(kd_latency_hist *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+    if (b >= KD_HIST_BUCKETS) b = KD_HIST_BUCKETS - 1;
 
-    while (!ctx->shutdown.load(std::memory_order_relaxed)) {
-        int buf_idx = ctx->ready_buf.load(std::memory_order_acquire);
-        if (buf_idx < 0) {
-            usleep(50000);  /* 50ms poll */
+    uint32_t n = h->buckets[b].load(std::memory_order_relaxed);
+    h->buckets[b].store(n + 1, std::memory_order_relaxed);
+    h->count.store(h->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h->total_ns.store(h->total_ns.load(std::memory_order_relaxed) + ns,
+                      std::memory_order_relaxed);
+    uint32_t ns32 = ns > 0xFFFFFFFFull ? 0xFFFFFFFFu : (uint32_t)ns;
+    if (ns32 > h->max_ns.load(std::memory_order_relaxed)) {
+        h->max_ns.store(ns32, std::memory_order_relaxed);
+    }
+}
+
+static void latency_reset(kd_latency_hist *h) {
+    for (int b = 0; b < KD_HIST_BUCKETS; b++) h->buckets[b].store(0, std::memory_order_relaxed);
+    h->count.store(0, std::memory_order_relaxed);
+    h->total_ns.store(0, std::memory_order_relaxed);
+    h->max_ns.store(0, std::memory_order_relaxed);
+}
+
+static void latency_read(const kd_latency_hist *h, kd_latency *out) {
+    out->count = h->count.load(std::memory_order_relaxed);
+    uint64_t total = h->total_ns.load(std::memory_order_relaxed);
+    out->mean_us = out->count ? (float)(total / 1000.0 / out->count) : 0.0f;
+    out->max_us = h->max_ns.load(std::memory_order_relaxed) / 1000.0f;
+    for (int b = 0; b < KD_HIST_BUCKETS; b++) {
+        out->buckets[b] = h->buckets[b].load(std::memory_order_relaxed);
+    }
+}
+
+/* Does this chunk reach the gate threshold?  Both sums vectorize. */
+static bool chunk_is_loud(const float *mono, int n, float power) {
+    float sum = 0.0f;
+    float peak = 0.0f;
+    for (int i = 0; i < n; i++) {
+        float sq = mono[i] * mono[i];
+        sum += sq;
+        peak = sq > peak ? sq : peak;
+    }
+    static const float peak_ratio = std::pow(10.0f, GATE_PEAK_DB / 10.0f);
+    return sum >= power * n || peak >= power * peak_ratio;
+}
+
+static uint64_t pack_config(int window_samples, int hop_samples) {
+    return ((uint64_t)(uint32_t)window_samples << 32) | (uint32_t)hop_samples;
+}
+
+/* kd_lite's tables: one set for ANALYSIS_RATE, built on first use */
+static const kd_lite_tables &lite_tables() {
+    static kd_lite_tables *tables = [] {
+        kd_lite_tables *t = new kd_lite_tables;
+        kd_lite_tables_init(t, ANALYSIS_RATE);
+        return t;
+    }();
+    return *tables;
+}
+
+/* The context's buffers, for the pool thread holding its slot.  Relaxed
+ * is enough: the thread that allocated them published them before
+ * releasing the slot, and every claim acquires it. */
+static kd_buffers *slot_bufs(const kd_context *ctx) {
+    return ctx->bufs.load(std::memory_order_relaxed);
+}
+
+/* Number of chroma frames the active engine produces from `samples` of
+ * audio.  libkeyfinder needs a whole FFTFRAMESIZE for its first frame;
+ * kd_lite emits one frame per CHROMA_HOP. */
+static int chroma_frames_for(const kd_context *ctx, int samples) {
+    int frames;
+    if (ctx->engine_active != KD_ENGINE_KEYFINDER) {
+        frames = samples / CHROMA_HOP;
+        if (frames < 1) frames = 1;
+    } else {
+        if (samples <= (int)KeyFinder::FFTFRAMESIZE) return 1;
+        frames = (samples - (int)KeyFinder::FFTFRAMESIZE) / CHROMA_HOP + 1;
+    }
+    return frames > MAX_CHROMA_FRAMES ? MAX_CHROMA_FRAMES : frames;
+}
+
+/* Append one frame, made from audio between ring positions `start` and
+ * `end`, to the ring and the session sum */
+static void push_frame(kd_context *ctx, const float *frame, int bands, uint32_t start,
+                       uint32_t end) {
+    if (ctx->session_reset.exchange(false, std::memory_order_acquire)) {
+        std::memset(ctx->session_chroma, 0, sizeof(ctx->session_chroma));
+        ctx->session_frames = 0;
+    }
+
+    kd_buffers *bufs = slot_bufs(ctx);
+    bufs->chroma_start[ctx->chroma_head] = start;
+    bufs->chroma_end[ctx->chroma_head] = end;
+    float *slot = bufs->chroma[ctx->chroma_head];
+    for (int b = 0; b < bands; b++) {
+        slot[b] = frame[b];
+        ctx->session_chroma[b] += frame[b];
+    }
+    ctx->session_frames++;
+    ctx->chroma_head = (ctx->chroma_head + 1) % MAX_CHROMA_FRAMES;
+    if (ctx->chroma_count < MAX_CHROMA_FRAMES) ctx->chroma_count++;
+}
+
+/* Move any frames libkeyfinder appended to the workspace, from audio
+ * between ring positions `start` and `end`, into the ring.  Returns the
+ * number of new frames. */
+static int absorb_chroma(kd_context *ctx, KeyFinder::Workspace &workspace, uint32_t start,
+                         uint32_t end) {
+    KeyFinder::Chromagram *cg = workspace.chromagram;
+    if (!cg) return 0;
+
+    int hops = (int)cg->getHops();
+    int bands = (int)cg->getBands();
+    if (bands > CHROMA_BANDS) bands = CHROMA_BANDS;
+    ctx->chroma_bands = bands;
+
+    float frame[CHROMA_BANDS];
+    for (int h = 0; h < hops; h++) {
+        for (int b = 0; b < bands; b++) frame[b] = (float)cg->getMagnitude(h, b);
+        push_frame(ctx, frame, bands, start, end);
+    }
+
+    /* Frames now live in the ring; don't let the workspace grow forever */
+    delete workspace.chromagram;
+    workspace.chromagram = NULL;
+    return hops;
+}
+
+/* Classify a sum of frames (e.g. the session sum) as a one-hop
+ * chromagram, or with kd_lite's profiles.  The (cosine) libkeyfinder
+ * classifier treats a sum like the frames it came from. */
+static KeyFinder::key_t classify_sum(kd_context *ctx, KeyFinder::KeyFinder &keyfinder,
+                                     const double *sum) {
+    uint64_t t0 = monotonic_ns();
+    KeyFinder::key_t key;
+    if (ctx->engine_active != KD_ENGINE_KEYFINDER) {
+        int profile = ctx->engine_active == KD_ENGINE_TEMPERLEY ? KD_LITE_TEMPERLEY
+                                                                : KD_LITE_KRUMHANSL;
+        key = (KeyFinder::key_t)kd_lite_classify(&lite_tables(), sum, ctx->chroma_bands, profile);
+    } else {
+        KeyFinder::Workspace &ws = slot_bufs(ctx)->session_ws;
+        for (int b = 0; b < ctx->chroma_bands; b++) ws.chromagram->setMagnitude(0, b, sum[b]);
+        key = keyfinder.keyOfChromagram(ws);
+    }
+    latency_add(&ctx->estimate_latency, monotonic_ns() - t0);
+    return key;
+}
+
+/* Classify `frames` ring frames ending `skip` frames before the newest.
+ * The persistent classify_ws chromagram always has MAX_CHROMA_FRAMES hops;
+ * unused leading hops are zeroed.  That only scales the collapsed chroma
+ * vector, which libkeyfinder's (cosine) classifier ignores. */
+static KeyFinder::key_t key_of_recent_chroma(kd_context *ctx,
+                                             KeyFinder::KeyFinder &keyfinder,
+                                             int frames, int skip) {
+    if (skip > ctx->chroma_count - 1) skip = ctx->chroma_count - 1;
+    if (skip < 0) skip = 0;
+    if (frames > ctx->chroma_count - skip) frames = ctx->chroma_count - skip;
+    if (frames <= 0) return KeyFinder::SILENCE;
+
+    kd_buffers *bufs = slot_bufs(ctx);
+    int slot = (ctx->chroma_head - skip - frames + 2 * MAX_CHROMA_FRAMES) % MAX_CHROMA_FRAMES;
+    int bands = ctx->chroma_bands;
+
+    /* kd_lite classifies the summed frames directly */
+    if (ctx->engine_active != KD_ENGINE_KEYFINDER) {
+        double sum[CHROMA_BANDS] = {};
+        for (int h = 0; h < frames; h++) {
+            const float *frame = bufs->chroma[slot];
+            for (int b = 0; b < bands; b++) sum[b] += frame[b];
+            slot = (slot + 1) % MAX_CHROMA_FRAMES;
+        }
+        return classify_sum(ctx, keyfinder, sum);
+    }
+
+    KeyFinder::Chromagram *cg = bufs->classify_ws.chromagram;
+    int empty = MAX_CHROMA_FRAMES - frames;
+    for (int h = 0; h < empty; h++) {
+        for (int b = 0; b < bands; b++) {
+            cg->setMagnitude(h, b, 0.0);
+        }
+    }
+
+    for (int h = empty; h < MAX_CHROMA_FRAMES; h++) {
+        const float *frame = bufs->chroma[slot];
+        for (int b = 0; b < bands; b++) {
+            cg->setMagnitude(h, b, frame[b]);
+        }
+        slot = (slot + 1) % MAX_CHROMA_FRAMES;
+    }
+
+    uint64_t t0 = monotonic_ns();
+    KeyFinder::key_t key = keyfinder.keyOfChromagram(bufs->classify_ws);
+    latency_add(&ctx->estimate_latency, monotonic_ns() - t0);
+    return key;
+}
+
+/* Classify the `samples` of audio before ring position `end` (to the
+ * nearest chroma hop), passing over any newer frames.  Spans are measured
+ * in audio, not ring frames: a frame counts if the audio it was made from
+ * starts inside the span (the newest one only has to end in it, so a span
+ * shorter than a frame still gets one).  A strided frame covers more audio than a
+ * contiguous one and they come further apart, so a span then has fewer
+ * frames than chroma_frames_for(samples), and *weight (may be NULL) gets
+ * the share it does have, so a thinned window can count for less. */
+static KeyFinder::key_t key_of_span(kd_context *ctx, KeyFinder::KeyFinder &keyfinder,
+                                    uint32_t end, int samples, float *weight) {
+    const uint32_t *starts = slot_bufs(ctx)->chroma_start;
+    const uint32_t *ends = slot_bufs(ctx)->chroma_end;
+    int full = chroma_frames_for(ctx, samples);
+
+    int skip = 0, frames = 0;
+    for (int i = 0; i < ctx->chroma_count && frames < full; i++) {
+        int slot = (ctx->chroma_head - 1 - i + MAX_CHROMA_FRAMES) % MAX_CHROMA_FRAMES;
+        int32_t age = (int32_t)(end - ends[slot]);
+        if (age <= -CHROMA_HOP) {
+            skip++;
             continue;
         }
+        if (age > samples || (frames > 0 && (int32_t)(end - starts[slot]) > samples)) break;
+        frames++;
+    }
+
+    if (weight) *weight = (float)frames / full;
+    return key_of_recent_chroma(ctx, keyfinder, frames, skip);
+}
+
+/* Ring position the newest frame's audio ends at (chroma_count > 0) */
+static uint32_t newest_frame_end(const kd_context *ctx) {
+    return slot_bufs(ctx)->chroma_end[(ctx->chroma_head - 1 + MAX_CHROMA_FRAMES) %
+                                      MAX_CHROMA_FRAMES];
+}
+
+static int horizon_key(KeyFinder::key_t key) {
+    return key >= 0 && key < KeyFinder::SILENCE ? (int)key : -1;
+}
+
+/* Refresh the fast, long and session keys; they go out with the next
+ * published result. */
+static void update_horizons(kd_context *ctx, KeyFinder::KeyFinder &keyfinder) {
+    ctx->horizon_keys[KD_HORIZON_FAST] = horizon_key(key_of_recent_chroma(ctx, keyfinder, 1, 0));
+    ctx->horizon_keys[KD_HORIZON_LONG] = horizon_key(key_of_span(
+        ctx, keyfinder, newest_frame_end(ctx), LONG_WINDOW_SECONDS * ANALYSIS_RATE, NULL));
+
+    if (ctx->session_frames == 0) return;
+    ctx->horizon_keys[KD_HORIZON_SESSION] =
+        horizon_key(classify_sum(ctx, keyfinder, ctx->session_chroma));
+}
+
+/* Append a key change to the cell's log.  Called by the cell's writer. */
+static void log_change(kd_result_cell *cell, int key, int prev_key, float confidence,
+                       uint32_t result_seq, uint64_t now) {
+    uint32_t n = cell->changes.load(std::memory_order_relaxed) + 1;
+    if (n == 0) n = 1;   /* 0 marks an entry being written */
+    kd_change_slot *slot = &cell->change_log[n % KD_KEY_CHANGES];
+
+    slot->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->key.store(key, std::memory_order_relaxed);
+    slot->prev_key.store(prev_key, std::memory_order_relaxed);
+    slot->confidence.store(confidence, std::memory_order_relaxed);
+    slot->result_seq.store(result_seq, std::memory_order_relaxed);
+    slot->time_ns.store(now, std::memory_order_relaxed);
+    slot->seq.store(n, std::memory_order_release);
+    cell->changes.store(n, std::memory_order_release);
+}
+
+/* Seqlock write side.  Returns false if another writer held the cell. */
+static bool cell_write(kd_result_cell *cell, int key, float confidence, float margin,
+                       const float *scores, const int *horizon_keys, uint64_t now) {
+    uint32_t seq = cell->seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !cell->seq.compare_exchange_strong(seq, seq + 1,
+                                                        std::memory_order_relaxed)) {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    int prev_key = cell->key.load(std::memory_order_relaxed);
+    if (key != prev_key && key >= 0 && key < KD_NUM_KEYS) {
+        log_change(cell, key, prev_key, confidence, (seq + 2) >> 1, now);
+    }
+    cell->key.store(key, std::memory_order_relaxed);
+    cell->confidence.store(confidence, std::memory_order_relaxed);
+    cell->margin.store(margin, std::memory_order_relaxed);
+    for (int k = 0; k < KD_NUM_KEYS; k++) {
+        cell->scores[k].store(scores[k], std::memory_order_relaxed);
+    }
+    for (int h = 0; h < KD_NUM_HORIZONS; h++) {
+        cell->horizon_keys[h].store(horizon_keys[h], std::memory_order_relaxed);
+    }
+
+    cell->seq.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+/* Seqlock read side: bounded retries, so an audio-thread caller can never
+ * spin on a preempted writer */
+static bool cell_read(const kd_result_cell *cell, kd_result *out) {
+    for (int attempt = 0; attempt < RESULT_READ_TRIES; attempt++) {
+        uint32_t before = cell->seq.load(std::memory_order_acquire);
+        if (before & 1) continue;
+
+        kd_result r;
+        r.seq = before >> 1;
+        r.key = cell->key.load(std::memory_order_relaxed);
+        r.confidence = cell->confidence.load(std::memory_order_relaxed);
+        r.margin = cell->margin.load(std::memory_order_relaxed);
+        for (int k = 0; k < KD_NUM_KEYS; k++) {
+            r.scores[k] = cell->scores[k].load(std::memory_order_relaxed);
+        }
+        for (int h = 0; h < KD_NUM_HORIZONS; h++) {
+            r.horizon_keys[h] = cell->horizon_keys[h].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (cell->seq.load(std::memory_order_relaxed) == before) {
+            *out = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Read the cell's key changes after `after`, oldest first; see
+ * kd_get_key_changes.  Entries overwritten mid-read are skipped. */
+static int changes_read(const kd_result_cell *cell, uint32_t after, kd_key_change *out, int max) {
+    uint32_t newest = cell->changes.load(std::memory_order_acquire);
+    if ((int32_t)(newest - after) < 0) after = 0;    /* cursor from another source */
+    uint32_t first = after + 1;
+    if (newest >= KD_KEY_CHANGES && (int32_t)(newest - KD_KEY_CHANGES + 1 - first) > 0) {
+        first = newest - KD_KEY_CHANGES + 1;
+    }
+
+    int count = 0;
+    for (uint32_t n = first; (int32_t)(newest - n) >= 0 && count < max; n++) {
+        const kd_change_slot *slot = &cell->change_log[n % KD_KEY_CHANGES];
+        if (slot->seq.load(std::memory_order_acquire) != n) continue;
+
+        kd_key_change c;
+        c.seq = n;
+        c.key = slot->key.load(std::memory_order_relaxed);
+        c.prev_key = slot->prev_key.load(std::memory_order_relaxed);
+        c.confidence = slot->confidence.load(std::memory_order_relaxed);
+        c.result_seq = slot->result_seq.load(std::memory_order_relaxed);
+        c.time_ns = slot->time_ns.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) != n) continue;
+        out[count++] = c;
+    }
+    return count;
+}
+
+static void cell_reset(kd_result_cell *cell) {
+    cell->seq.store(0, std::memory_order_relaxed);
+    cell->changes.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < KD_KEY_CHANGES; i++) {
+        cell->change_log[i].seq.store(0, std::memory_order_relaxed);
+    }
+    cell->key.store(-1, std::memory_order_relaxed);
+    cell->confidence.store(0.0f, std::memory_order_relaxed);
+    cell->margin.store(0.0f, std::memory_order_relaxed);
+    for (int k = 0; k < KD_NUM_KEYS; k++) {
+        cell->scores[k].store(0.0f, std::memory_order_relaxed);
+    }
+    for (int h = 0; h < KD_NUM_HORIZONS; h++) {
+        cell->horizon_keys[h].store(-1, std::memory_order_relaxed);
+    }
+}
+
+/* The cell readers should see: the group's while this context follows */
+static const kd_result_cell *current_cell(kd_context *ctx) {
+    kd_share_group *group = ctx->share.load(std::memory_order_acquire);
+    if (group && ctx->following.load(std::memory_order_acquire)) return &group->result;
+    return &ctx->result;
+}
+
+/* Publish the current votes as the new result, and as the group's if
+ * this context leads one. */
+static void publish_result(kd_context *ctx, int key, float confidence, float margin) {
+    uint64_t now = monotonic_ns();
+    ctx->result_time.store(now, std::memory_order_relaxed);
+    if (key != ctx->result.key.load(std::memory_order_relaxed)) {
+        ctx->key_time.store(now, std::memory_order_relaxed);
+    }
+    ctx->horizon_keys[KD_HORIZON_WINDOW] = key;
+    cell_write(&ctx->result, key, confidence, margin, ctx->votes, ctx->horizon_keys, now);
+
+    kd_share_group *group = ctx->share.load(std::memory_order_acquire);
+    if (group && group->leader.load(std::memory_order_relaxed) == ctx) {
+        cell_write(&group->result, key, confidence, margin, ctx->votes, ctx->horizon_keys, now);
+    }
+}
+
+/* Add one key estimate to the decaying vote and publish the winner.
+ * decay is applied to the old votes first. */
+static void cast_vote(kd_context *ctx, KeyFinder::key_t key, float decay, float weight) {
+    if (key < 0 || key >= KeyFinder::SILENCE) return;
+
+    /* Decay old votes so recent estimates dominate */
+    for (int k = 0; k < NUM_KEYS; k++) {
+        ctx->votes[k] *= decay;
+    }
+
+    /* Cast new vote */
+    ctx->votes[key] += weight;
+
+    /* Find the key with the most votes, and the runner-up */
+    int best_key = key;
+    float best_count = 0.0f;
+    float second_count = 0.0f;
+    float total = 0.0f;
+    for (int k = 0; k < KD_NUM_KEYS; k++) {  /* exclude SILENCE */
+        float v = ctx->votes[k];
+        total += v;
+        if (v > best_count) {
+            second_count = best_count;
+            best_count = v;
+            best_key = k;
+        } else if (v > second_count) {
+            second_count = v;
+        }
+    }
+
+    publish_result(ctx, best_key,
+                   total > 0.0f ? best_count / total : 0.0f,
+                   total > 0.0f ? (best_count - second_count) / total : 0.0f);
+}
+
+static double thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
 
-        int len = ctx->ready_len.load(std::memory_order_relaxed);
+static void note_run(double ns) {
+    uint32_t us = (uint32_t)(ns / 1000.0);
+    uint32_t seen = g_sched.max_run_us.load(std::memory_order_relaxed);
+    while (us > seen && !g_sched.max_run_us.compare_exchange_weak(seen, us,
+                                                                  std::memory_order_relaxed)) {}
+}
+
+static void set_stride(kd_context *ctx, int stride) {
+    ctx->stride = stride;
+    ctx->stride_phase = 0;
+    ctx->stable_estimates = 0;
+    ctx->stride_shown.store(stride, std::memory_order_relaxed);
+}
+
+/* Audio one frame spans at `stride`: a libkeyfinder frame is FRAME_CHUNKS
+ * chunks fed one `stride` apart, a kd_lite frame is a single chunk */
+static int strided_frame_span(const kd_context *ctx, int stride) {
+    int chunks = ctx->engine_active != KD_ENGINE_KEYFINDER ? 1 : FRAME_CHUNKS;
+    return ((chunks - 1) * stride + 1) * CHROMA_HOP;
+}
 
-        /* Mark consumed immediately so audio thread can queue next */
-        ctx->ready_buf.store(-1, std::memory_order_release);
+/* Adapt the stride to how a new estimate compares with the tally before
+ * it was cast: hold back while the key is locked in, hurry on a change.
+ * It never doubles past a frame spanning more than the window. */
+static void adapt_stride(kd_context *ctx, KeyFinder::key_t key, int prev_winner,
+                         float prev_margin) {
+    if (key < 0 || key >= KeyFinder::SILENCE) return;
 
-        if (len <= 0) continue;
+    if (key != prev_winner) {
+        if (ctx->stride > 1) set_stride(ctx, 1);
+        ctx->stable_estimates = 0;
+    } else if (prev_margin >= STABLE_MARGIN &&
+               ++ctx->stable_estimates >= STABLE_ESTIMATES &&
+               ctx->stride < MAX_STRIDE &&
+               strided_frame_span(ctx, ctx->stride * 2) <= ctx->window_samples) {
+        set_stride(ctx, ctx->stride * 2);
+    }
+}
 
-        /* Build AudioData */
-        KeyFinder::AudioData audio;
-        audio.setChannels(1);
-        audio.setFrameRate(EFFECTIVE_RATE);
-        audio.addToSampleCount(len);
+/* Should the next chunk get chroma?  Charges nothing; see analyze_pending. */
+static bool chunk_wanted(kd_context *ctx, float budget) {
+    /* Refill by one chunk of audio time; allow a second's worth of burst */
+    if (budget < 1.0f) {
+        ctx->budget_tokens += budget * CHUNK_NS;
+        if (ctx->budget_tokens > budget * 1e9) ctx->budget_tokens = budget * 1e9;
+    }
 
-        for (int i = 0; i < len; i++) {
-            audio.setSample(i, ctx->bufs[buf_idx][i]);
+    bool due = ctx->stride_phase == 0;
+    if (++ctx->stride_phase >= ctx->stride) ctx->stride_phase = 0;
+    if (!due) return false;
+    return budget >= 1.0f || ctx->budget_tokens > 0.0;
+}
+
+/* Take up a new window/hop handed over by the audio thread.  The chroma
+ * ring is kept, so a new window is re-estimated at once from the chroma we
+ * already have instead of starting cold; the old votes were cast with the
+ * old window and are dropped. */
+static void apply_config(kd_context *ctx, KeyFinder::KeyFinder &keyfinder, uint64_t cfg) {
+    int old_window = ctx->window_samples;
+    ctx->config_applied = cfg;
+    ctx->window_samples = (int)(cfg >> 32);
+    ctx->hop_samples = (int)(cfg & 0xffffffffu);
+
+    /* A shorter hop must not turn the current backlog into missed hops */
+    if (ctx->hop_accum > ctx->hop_samples) ctx->hop_accum = ctx->hop_samples;
+
+    if (ctx->window_samples == old_window) return;
+    std::memset(ctx->votes, 0, sizeof(ctx->votes));
+    set_stride(ctx, 1);
+    if (ctx->chroma_count == 0) return;
+
+    float weight;
+    KeyFinder::key_t key = key_of_span(ctx, keyfinder, newest_frame_end(ctx),
+                                       ctx->window_samples, &weight);
+    update_horizons(ctx, keyfinder);
+    cast_vote(ctx, key, 1.0f, weight);
+    ctx->hop_accum = 0;
+
+    uint32_t a = ctx->windows_analyzed.load(std::memory_order_relaxed);
+    ctx->windows_analyzed.store(a + 1, std::memory_order_relaxed);
+}
+
+/* Bar-synchronous estimates.  Once the audio up to the latest boundary
+ * from kd_sync_boundary has been analysed, classify the chroma between it
+ * and the previous boundary (to the nearest chroma hop).  Returns true
+ * while boundaries are arriving, in which case they replace the hop
+ * schedule. */
+static bool sync_estimate(kd_context *ctx, KeyFinder::KeyFinder &keyfinder, uint32_t read) {
+    uint64_t req = ctx->sync_request.load(std::memory_order_acquire);
+    uint32_t count = (uint32_t)(req >> 32);
+    uint32_t mark = (uint32_t)req;
+
+    if (count != ctx->sync_seen && (int32_t)(read - mark) >= 0) {
+        int span = (int)(mark - ctx->sync_mark);
+        bool have_span = ctx->sync_seen != 0 && span > 0 && span <= SYNC_TIMEOUT;
+        ctx->sync_seen = count;
+        ctx->sync_mark = mark;
+        ctx->sync_span = have_span ? span : 0;
+        ctx->sync_since = (int)(read - mark);
+
+        if (have_span) {
+            /* The stride would thin out the bar's chroma; keep every chunk */
+            if (ctx->stride > 1) set_stride(ctx, 1);
+            float weight;
+            KeyFinder::key_t key = key_of_span(ctx, keyfinder, mark, span, &weight);
+            update_horizons(ctx, keyfinder);
+            cast_vote(ctx, key, VOTE_DECAY, weight);
+            ctx->hop_accum = 0;
+
+            uint32_t a = ctx->windows_analyzed.load(std::memory_order_relaxed);
+            ctx->windows_analyzed.store(a + 1, std::memory_order_relaxed);
         }
+    }
 
-        /* Run analysis */
-        KeyFinder::key_t key = keyfinder.keyOfAudio(audio);
+    int timeout = ctx->sync_span > 0 ? ctx->sync_span + SYNC_SLACK : SYNC_TIMEOUT;
+    if (timeout > SYNC_TIMEOUT) timeout = SYNC_TIMEOUT;
+    return ctx->sync_seen != 0 && ctx->sync_since < timeout;
+}
 
-        if (key >= 0 && key < KeyFinder::SILENCE) {
-            /* Decay old votes so recent windows dominate */
-            for (int k = 0; k < NUM_KEYS; k++) {
-                ctx->votes[k] *= VOTE_DECAY;
+/* Start over on another engine: its chroma can't be classified alongside
+ * the old engine's, so the ring, session and votes restart with it.  The
+ * result stays up until the new engine publishes. */
+static void switch_engine(kd_context *ctx, int engine) {
+    ctx->engine_active = engine;
+    ctx->chroma_head = 0;
+    ctx->chroma_count = 0;
+    ctx->chroma_bands = engine != KD_ENGINE_KEYFINDER ? KD_LITE_BANDS : 0;
+    std::memset(ctx->session_chroma, 0, sizeof(ctx->session_chroma));
+    ctx->session_frames = 0;
+    std::memset(ctx->votes, 0, sizeof(ctx->votes));
+    set_stride(ctx, 1);
+    kd_lite_reset(&slot_bufs(ctx)->lite);
+    /* libkeyfinder's FFT overlap is left as it is: on a switch back it
+     * splices in under one frame of old audio, as a skipped backlog does */
+}
+
+/* Allocate the context's buffers once the audio thread has asked for
+ * them.  Called with the slot held.  Returns NULL while they aren't wanted
+ * yet, or if they can't be had (the next kick tries again). */
+static kd_buffers *claim_bufs(kd_context *ctx) {
+    kd_buffers *bufs = slot_bufs(ctx);
+    if (bufs || !ctx->want_bufs.load(std::memory_order_acquire)) return bufs;
+
+    bufs = new (std::nothrow) kd_buffers();
+    if (!bufs) return NULL;
+    bufs->chunk.setChannels(1);
+    bufs->chunk.setFrameRate(ANALYSIS_RATE);
+    bufs->chunk.addToSampleCount(CHROMA_HOP);
+    bufs->classify_ws.chromagram = new (std::nothrow) KeyFinder::Chromagram(MAX_CHROMA_FRAMES);
+    bufs->session_ws.chromagram = new (std::nothrow) KeyFinder::Chromagram(1);
+    if (!bufs->classify_ws.chromagram || !bufs->session_ws.chromagram) {
+        delete bufs;
+        return NULL;
+    }
+    kd_lite_reset(&bufs->lite);
+
+    /* The audio thread starts writing the ring once it sees this */
+    ctx->bufs.store(bufs, std::memory_order_release);
+    return bufs;
+}
+
+/* Analyse whatever audio has been published since the last call: turn it
+ * into chroma a CHROMA_HOP chunk at a time, and refresh the key estimate
+ * each time another hop_seconds has gone by.  Called with the context's
+ * pool slot held, so only one thread runs it per context at a time. */
+static void analyze_pending(kd_context *ctx, KeyFinder::KeyFinder &keyfinder) {
+    kd_buffers *bufs = claim_bufs(ctx);
+    if (!bufs) return;
+    int engine = ctx->engine.load(std::memory_order_relaxed);
+    if (engine != ctx->engine_active) switch_engine(ctx, engine);
+    uint64_t cfg = ctx->config_active.load(std::memory_order_acquire);
+    if (cfg != ctx->config_applied) apply_config(ctx, keyfinder, cfg);
+
+    uint32_t read = ctx->ring_read.load(std::memory_order_relaxed);
+    uint32_t published = ctx->ring_published.load(std::memory_order_acquire);
+    int len = (int)(published - read);
+    if (len < CHROMA_HOP) return;
+
+    int window_samples = ctx->window_samples;
+    int hop_samples = ctx->hop_samples;
+
+    /* Read at our own pace.  If we've fallen half a ring behind, the
+     * backlog is stale: keep one FFT frame's worth so the next chroma frame
+     * is all fresh audio, and skip the rest (the chroma stream is spliced,
+     * which is harmless for key detection) rather than letting the ring
+     * fill up under the audio thread. */
+    if (len > RING_SAMPLES / 2) {
+        int skip = len - (int)KeyFinder::FFTFRAMESIZE;
+        int skipped_hops = skip / hop_samples;
+        uint32_t c = ctx->windows_coalesced.load(std::memory_order_relaxed);
+        ctx->windows_coalesced.store(c + (skipped_hops > 0 ? skipped_hops : 1),
+                                     std::memory_order_relaxed);
+        read += skip;
+        len -= skip;
+    }
+
+    /* Hand the ring to libkeyfinder in CHROMA_HOP chunks.  AudioData has
+     * no bulk import, so this is the one float -> double pass; the chunk
+     * itself is allocated once and reused.  Chunks the scheduler passes
+     * over are released unread.  With time-slicing on, yield between
+     * chunks (one FFT frame each) whenever a slice has been used up. */
+    float budget = ctx->cpu_budget.load(std::memory_order_relaxed);
+    float load = ctx->cpu_load.load(std::memory_order_relaxed);
+    double slice_ns = g_sched.slice_us.load(std::memory_order_relaxed) * 1000.0;
+    double run_start = thread_cpu_ns();
+    int chunks = len / CHROMA_HOP;
+    for (int c = 0; c < chunks; c++) {
+        if (slice_ns > 0 && c > 0) {
+            double run = thread_cpu_ns() - run_start;
+            if (run >= slice_ns) {
+                note_run(run);
+                sched_yield();
+                run_start = thread_cpu_ns();
             }
+        }
+
+        if (!chunk_wanted(ctx, budget)) {
+            read += CHROMA_HOP;
+            ctx->ring_read.store(read, std::memory_order_release);
+            load *= 0.9f;
+            continue;
+        }
 
-            /* Cast new vote */
-            ctx->votes[key] += 1.0f;
-
-            /* Find the key with the most votes */
-            int best_key = key;
-            float best_count = 0.0f;
-            for (int k = 0; k < NUM_KEYS - 1; k++) {  /* exclude SILENCE */
-                if (ctx->votes[k] > best_count) {
-                    best_count = ctx->votes[k];
-                    best_key = k;
-                }
+        double t0 = thread_cpu_ns();
+        uint64_t wall0 = monotonic_ns();
+        if (ctx->engine_active != KD_ENGINE_KEYFINDER) {
+            /* kd_lite takes floats straight from the ring */
+            float samples[CHROMA_HOP];
+            for (int i = 0; i < CHROMA_HOP; i++) samples[i] = bufs->ring[(read + i) & RING_MASK];
+            read += CHROMA_HOP;
+            ctx->ring_read.store(read, std::memory_order_release);
+
+            float frame[KD_LITE_BANDS] = {};
+            if (kd_lite_process(&lite_tables(), &bufs->lite, samples, CHROMA_HOP, frame) > 0) {
+                push_frame(ctx, frame, KD_LITE_BANDS, read - CHROMA_HOP, read);
+            }
+        } else {
+            for (int i = 0; i < CHROMA_HOP; i++) {
+                bufs->chunk.setSample(i, bufs->ring[(read + i) & RING_MASK]);
             }
+            ctx->kf_fed[ctx->kf_fed_next] = read;
+            ctx->kf_fed_next = (ctx->kf_fed_next + 1) % FRAME_CHUNKS;
+            read += CHROMA_HOP;
 
-            /* Update displayed key to majority winner */
-            char tmp[16];
-            std::strncpy(tmp, key_names[best_key], sizeof(tmp) - 1);
-            tmp[sizeof(tmp) - 1] = '\0';
-            std::memcpy(ctx->detected_key, tmp, 16);
+            /* Release the samples once copied so audio thread can reuse them */
+            ctx->ring_read.store(read, std::memory_order_release);
+
+            /* A frame ending here is made of the last FRAME_CHUNKS chunks
+             * fed, which the stride or a skipped backlog may have spread
+             * out: it starts where the oldest of them did */
+            keyfinder.progressiveChromagram(bufs->chunk, bufs->workspace);
+            absorb_chroma(ctx, bufs->workspace, ctx->kf_fed[ctx->kf_fed_next], read);
         }
+        latency_add(&ctx->chroma_latency, monotonic_ns() - wall0);
+
+        double spent = thread_cpu_ns() - t0;
+        if (budget < 1.0f) ctx->budget_tokens -= spent;
+        load = 0.9f * load + 0.1f * (float)(spent / CHUNK_NS);
     }
+    ctx->cpu_load.store(load, std::memory_order_relaxed);
+    note_run(thread_cpu_ns() - run_start);
+
+    ctx->hop_accum += chunks * CHROMA_HOP;
+    if (ctx->sync_since < SYNC_TIMEOUT) ctx->sync_since += chunks * CHROMA_HOP;
+    if (ctx->chroma_count == 0) {
+        /* Still filling the first FFT frame: that's not a missed estimate */
+        if (ctx->hop_accum > hop_samples) ctx->hop_accum = hop_samples;
+        return;
+    }
+    if (sync_estimate(ctx, keyfinder, read)) {
+        /* Hops are on hold, not missed */
+        if (ctx->hop_accum > hop_samples) ctx->hop_accum = hop_samples;
+        return;
+    }
+    int hops = ctx->hop_accum / hop_samples;
+    if (hops == 0) return;
+    ctx->hop_accum -= hops * hop_samples;
+
+    /* Several hops that went by while we were busy become one estimate */
+    if (hops > 1) {
+        uint32_t c = ctx->windows_coalesced.load(std::memory_order_relaxed);
+        ctx->windows_coalesced.store(c + hops - 1, std::memory_order_relaxed);
+    }
+
+    /* Refresh the estimate over the last window of chroma.  We are the
+     * only writer of the published result, so relaxed loads of it are our
+     * own last tally. */
+    int prev_winner = ctx->result.key.load(std::memory_order_relaxed);
+    float prev_margin = ctx->result.margin.load(std::memory_order_relaxed);
+    float weight;
+    KeyFinder::key_t key = key_of_span(ctx, keyfinder, newest_frame_end(ctx),
+                                       window_samples, &weight);
+    update_horizons(ctx, keyfinder);
+    cast_vote(ctx, key, std::pow(VOTE_DECAY, (float)(hops * hop_samples) / window_samples),
+              weight);
+    adapt_stride(ctx, key, prev_winner, prev_margin);
+
+    uint32_t a = ctx->windows_analyzed.load(std::memory_order_relaxed);
+    ctx->windows_analyzed.store(a + 1, std::memory_order_relaxed);
+}
+
+/* ------------------------------------------------------------------ */
+/* Shared analysis pool                                                */
+/* ------------------------------------------------------------------ */
+
+/*
+ * One set of low-priority threads serves every kd_context in the process,
+ * so thread count stays flat however many instances are loaded.  Contexts
+ * register in a fixed slot table.  A pool thread claims a slot (slot_busy)
+ * before touching the context behind it, which is also what makes
+ * teardown safe without waiting: kd_destroy marks the slot dying and
+ * frees the context at once if no thread holds the slot, or leaves it to
+ * the thread that does, which frees it on its next claim.  Scans
+ * start at a rotating cursor and each claim does one batch, so busy
+ * instances can't starve the rest.
+ *
+ * `queued` is set when a context has work (a published chunk, a request)
+ * and cleared by the pool thread that picks the slot up, so each context
+ * has at most one wakeup outstanding and idle or stopped instances cost
+ * nothing.  Like `dying`, it lives in the pool rather than the context,
+ * so a thread can still check it after the context has been freed.
+ *
+ * The pool is started by the first kd_create and joined by the last
+ * kd_destroy, which then frees whatever is still waiting itself.  `lock`
+ * only guards that lifecycle and slot assignment; the audio thread never
+ * takes it.
+ */
+#define POOL_MAX_THREADS 4
+#define POOL_MAX_CONTEXTS 64
+
+struct kd_pool {
+    std::mutex lock;
+    int refs;
+    int nthreads;
+    std::thread threads[POOL_MAX_THREADS];
+    std::atomic<bool> shutdown;
+    kd_sem_t wake;
+    std::atomic<kd_context*> slots[POOL_MAX_CONTEXTS];
+    std::atomic<int> slot_busy[POOL_MAX_CONTEXTS];
+    std::atomic<bool> queued[POOL_MAX_CONTEXTS];
+    std::atomic<bool> dying[POOL_MAX_CONTEXTS];  /* destroyed, not yet freed */
+    std::atomic<unsigned> cursor;
+};
+
+static kd_pool g_pool;
+
+/* Queue ctx with the pool unless it is already queued (try-post).  Never
+ * blocks, so the audio thread can use it. */
+static void pool_kick(kd_context *ctx) {
+    if (!g_pool.queued[ctx->pool_slot].exchange(true, std::memory_order_seq_cst)) {
+        kd_sem_post(&g_pool.wake);
+    }
+}
+
+/* Free the destroyed context in slot and free the slot.  Called with the
+ * slot held, or with the pool stopped. */
+static void reclaim_slot(int slot) {
+    kd_context *ctx = g_pool.slots[slot].load(std::memory_order_relaxed);
+    g_pool.dying[slot].store(false, std::memory_order_relaxed);
+    g_pool.slots[slot].store(NULL, std::memory_order_release);
+
+    kd_resampler_free(&ctx->resampler);
+    delete ctx->bufs.load(std::memory_order_relaxed);
+    delete ctx;
+}
+
+/* Reclaim a dying slot now, unless a pool thread has it (it then frees
+ * the context itself once it lets go).  Returns true if reclaimed. */
+static bool try_reclaim(int slot) {
+    int expected = 0;
+    if (!g_pool.slot_busy[slot].compare_exchange_strong(expected, 1,
+                                                        std::memory_order_acquire)) {
+        return false;
+    }
+    bool dying = g_pool.dying[slot].load(std::memory_order_relaxed);
+    if (dying) reclaim_slot(slot);
+    g_pool.slot_busy[slot].store(0, std::memory_order_seq_cst);
+    return dying;
+}
+
+/* Log the stats line if kd_set_stats_log asked for it and it's due.
+ * Called with the context's slot held. */
+static void log_stats(kd_context *ctx) {
+    kd_log_fn log = ctx->stats_log.load(std::memory_order_acquire);
+    float interval = ctx->stats_log_interval.load(std::memory_order_relaxed);
+    if (!log || interval <= 0.0f) return;
+
+    uint64_t now = monotonic_ns();
+    if (ctx->stats_logged && now - ctx->stats_logged < (uint64_t)(interval * 1e9)) return;
+    ctx->stats_logged = now;
+
+    char line[STATS_LINE];
+    int len = snprintf(line, sizeof(line), "[keydetect] stats ");
+    if (kd_format_stats(ctx, line + len, (int)sizeof(line) - len) > 0) log(line);
+}
+
+/* Claim and service one queued context.  Returns false if none was found. */
+static bool pool_service_one(KeyFinder::KeyFinder &keyfinder) {
+    unsigned start = g_pool.cursor.fetch_add(1, std::memory_order_relaxed);
+
+    for (int i = 0; i < POOL_MAX_CONTEXTS; i++) {
+        int slot = (int)((start + i) % POOL_MAX_CONTEXTS);
+        if (!g_pool.slots[slot].load(std::memory_order_relaxed)) continue;
+
+        int expected = 0;
+        if (!g_pool.slot_busy[slot].compare_exchange_strong(expected, 1,
+                                                            std::memory_order_acquire)) {
+            continue;  /* another pool thread has it; it re-posts if needed */
+        }
+
+        kd_context *ctx = g_pool.slots[slot].load(std::memory_order_acquire);
+        bool serviced = false;
+        if (ctx && g_pool.queued[slot].exchange(false, std::memory_order_seq_cst)) {
+            if (g_pool.dying[slot].load(std::memory_order_seq_cst)) {
+                reclaim_slot(slot);
+            } else {
+                analyze_pending(ctx, keyfinder);
+                log_stats(ctx);
+            }
+            serviced = true;
+        }
+
+        g_pool.slot_busy[slot].store(0, std::memory_order_seq_cst);
+
+        /* A chunk published while we held the slot may have had its wakeup
+         * consumed by a thread that found the slot busy: hand it on.  (ctx
+         * may be freed by now; only the pool's own flags are read.) */
+        if (ctx && g_pool.queued[slot].load(std::memory_order_seq_cst)) {
+            kd_sem_post(&g_pool.wake);
+        }
+        if (serviced) return true;
+    }
+    return false;
+}
+
+/* ------------------------------------------------------------------ */
+/* Shared spectral kernels                                             */
+/* ------------------------------------------------------------------ */
+
+/*
+ * libkeyfinder keeps its low-pass filters, temporal window and chroma
+ * transform in per-KeyFinder factories, cached by frame rate (and its one
+ * FFT size).  We always analyse at ANALYSIS_RATE, so a single process-wide
+ * KeyFinder serves every context and pool thread; the factories lock
+ * internally and the per-stream state lives in each context's Workspace.
+ * It outlives pool restarts, so reloading a patch doesn't rebuild kernels.
+ */
+static KeyFinder::KeyFinder &shared_keyfinder() {
+    static KeyFinder::KeyFinder keyfinder;
+    return keyfinder;
+}
+
+static std::atomic<bool> g_kernels_warm(false);
+static char g_cache_dir[512];           /* guarded by g_pool.lock */
+
+/* Build the kernels (and an FFTW plan of our size) by analysing one FFT
+ * frame of silence, so the first real analysis after a patch load doesn't
+ * stall on setup.  Runs once, on a pool thread. */
+static void warm_kernels() {
+    if (g_kernels_warm.exchange(true)) return;
+
+    KeyFinder::Workspace workspace;
+    KeyFinder::AudioData silence;
+    silence.setChannels(1);
+    silence.setFrameRate(ANALYSIS_RATE);
+    silence.addToSampleCount(KeyFinder::FFTFRAMESIZE);
+    shared_keyfinder().progressiveChromagram(silence, workspace);
+}
+
+#if defined(KD_FFTW_WISDOM)
+/* Optional on-disk FFTW wisdom, so FftAdapter planning is a lookup.
+ * Only called while no pool thread is running (FFTW's planner isn't
+ * thread-safe). */
+static void wisdom_path(char *buf, int len) {
+    snprintf(buf, len, "%s/keydetect.fftw_wisdom", g_cache_dir);
+}
+
+static void load_wisdom() {
+    if (!g_cache_dir[0]) return;
+    char path[600];
+    wisdom_path(path, sizeof(path));
+    fftw_import_wisdom_from_filename(path);
+}
+
+static void save_wisdom() {
+    if (!g_cache_dir[0]) return;
+    char path[600];
+    wisdom_path(path, sizeof(path));
+    fftw_export_wisdom_to_filename(path);
+}
+#else
+static void load_wisdom() {}
+static void save_wisdom() {}
+#endif
+
+/* Apply the kd_set_scheduling policy and affinity to the calling thread.
+ * Failures leave the thread as it was; there's nothing better to do. */
+static void apply_scheduling() {
+#if defined(__linux__)
+    int policy = g_sched.policy.load(std::memory_order_relaxed);
+    struct sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(),
+                          policy == KD_SCHED_IDLE ? SCHED_IDLE :
+                          policy == KD_SCHED_BATCH ? SCHED_BATCH : SCHED_OTHER,
+                          &param);
+
+    uint64_t mask = g_sched.cpu_mask.load(std::memory_order_relaxed);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!mask || (cpu < 64 && (mask >> cpu) & 1)) CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void pool_thread_fn() {
+    /* Set low priority so we don't compete with audio (SCHED_BATCH honours
+     * it too; SCHED_IDLE is below any nice level anyway) */
+    nice(10);
+    uint32_t sched_gen = g_sched.gen.load(std::memory_order_acquire);
+    apply_scheduling();
+
+    KeyFinder::KeyFinder &keyfinder = shared_keyfinder();
+    warm_kernels();
+
+    while (true) {
+        kd_sem_wait(&g_pool.wake);
+        if (g_pool.shutdown.load(std::memory_order_acquire)) break;
+
+        uint32_t gen = g_sched.gen.load(std::memory_order_acquire);
+        if (gen != sched_gen) {
+            sched_gen = gen;
+            apply_scheduling();
+        }
+        pool_service_one(keyfinder);
+    }
+}
+
+/* Join all pool threads, then free the destroyed contexts they hadn't got
+ * to.  Idle threads are parked on the semaphore and exit at once; only a
+ * pass already under way is waited for.  Called with g_pool.lock held. */
+static void pool_stop_locked() {
+    g_pool.shutdown.store(true, std::memory_order_release);
+    for (int i = 0; i < g_pool.nthreads; i++) kd_sem_post(&g_pool.wake);
+    for (int i = 0; i < g_pool.nthreads; i++) g_pool.threads[i].join();
+    g_pool.nthreads = 0;
+    kd_sem_destroy(&g_pool.wake);
+    save_wisdom();
+
+    for (int slot = 0; slot < POOL_MAX_CONTEXTS; slot++) {
+        if (g_pool.slots[slot].load(std::memory_order_relaxed)) reclaim_slot(slot);
+        g_pool.queued[slot].store(false, std::memory_order_relaxed);
+    }
+}
+
+/* Register ctx with the pool, starting it if this is the first context.
+ * Returns false if the pool could not be started or is full. */
+static bool pool_attach(kd_context *ctx) {
+    std::lock_guard<std::mutex> guard(g_pool.lock);
+
+    if (g_pool.refs == 0) {
+        if (!kd_sem_init(&g_pool.wake)) return false;
+        g_pool.shutdown.store(false, std::memory_order_relaxed);
+        load_wisdom();
+
+        /* Leave a core for the audio thread */
+        int cores = (int)std::thread::hardware_concurrency();
+        int n = cores - 1;
+        if (n < 1) n = 1;
+        if (n > POOL_MAX_THREADS) n = POOL_MAX_THREADS;
+
+        g_pool.nthreads = 0;
+        for (int i = 0; i < n; i++) {
+            try {
+                g_pool.threads[i] = std::thread(pool_thread_fn);
+            } catch (...) {
+                break;
+            }
+            g_pool.nthreads++;
+        }
+        if (g_pool.nthreads == 0) {
+            kd_sem_destroy(&g_pool.wake);
+            return false;
+        }
+    }
+
+    /* Slots still dying count as taken, unless the pool is done with them */
+    for (int slot = 0; slot < POOL_MAX_CONTEXTS; slot++) {
+        if (!g_pool.slots[slot].load(std::memory_order_acquire) ||
+            (g_pool.dying[slot].load(std::memory_order_acquire) && try_reclaim(slot))) {
+            ctx->pool_slot = slot;
+            g_pool.queued[slot].store(false, std::memory_order_relaxed);
+            g_pool.slots[slot].store(ctx, std::memory_order_release);
+            g_pool.refs++;
+            return true;
+        }
+    }
+
+    /* Pool full; undo the startup above if nothing else is registered */
+    if (g_pool.refs == 0) pool_stop_locked();
+    return false;
+}
+
+/* Unregister ctx and free it, without waiting for a pass that may be
+ * under way on it: then the slot is queued for the pool to free instead.
+ * Stops the pool if this was the last context.  Called with g_pool.lock
+ * held. */
+static void pool_detach_locked(kd_context *ctx) {
+    int slot = ctx->pool_slot;
+    g_pool.dying[slot].store(true, std::memory_order_seq_cst);
+    if (--g_pool.refs == 0) {
+        pool_stop_locked();
+    } else if (!try_reclaim(slot) &&
+               !g_pool.queued[slot].exchange(true, std::memory_order_seq_cst)) {
+        /* By slot, not pool_kick: the holder may free ctx any moment now */
+        kd_sem_post(&g_pool.wake);
+    }
+}
+
+/* Audio thread side of a queued window/hop change: take it up and hand it
+ * to the worker.  Returns true if there was one. */
+static bool take_config(kd_context *ctx) {
+    uint64_t cfg = ctx->config_request.load(std::memory_order_acquire);
+    if (cfg == ctx->config_fed) return false;
+    ctx->config_fed = cfg;
+    ctx->feed_hop_samples = (int)(cfg & 0xffffffffu);
+    ctx->config_active.store(cfg, std::memory_order_release);
+    return true;
+}
+
+/* Cheap block fingerprint: FNV-1a over every 7th sample, which walks both
+ * channels as they interleave. */
+static uint64_t block_fingerprint(const int16_t *stereo, int frames) {
+    uint64_t h = 1469598103934665603ull ^ (uint64_t)frames;
+    for (int i = 0; i < frames * 2; i += 7) {
+        h = (h ^ (uint16_t)stereo[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/* Audio thread side of a share group: fingerprint the block, keep the
+ * leader election going and decide whether to follow.  Returns true if
+ * the leader's analysis covers this block, so it needn't be analysed. */
+static bool share_block(kd_context *ctx, kd_share_group *group,
+                        const int16_t *stereo, int frames) {
+    uint64_t prev_fp = ctx->share_fp;
+    uint64_t fp = block_fingerprint(stereo, frames);
+    ctx->share_fp = fp;
+
+    kd_context *leader = group->leader.load(std::memory_order_acquire);
+    if (!leader) {
+        group->leader.compare_exchange_strong(leader, ctx, std::memory_order_acq_rel);
+    } else if (leader != ctx) {
+        uint32_t blocks = group->blocks.load(std::memory_order_acquire);
+        if (blocks != ctx->share_blocks_seen) {
+            ctx->share_blocks_seen = blocks;
+            ctx->share_stall = 0;
+        } else if (++ctx->share_stall > SHARE_STALL_BLOCKS) {
+            /* The leader has stopped being fed; take over (losing the
+             * race to another member is fine) */
+            group->leader.compare_exchange_strong(leader, ctx, std::memory_order_acq_rel);
+            ctx->share_stall = 0;
+        }
+    }
+
+    if (group->leader.load(std::memory_order_acquire) == ctx) {
+        uint32_t n = group->blocks.load(std::memory_order_relaxed);
+        group->fingerprints[n % SHARE_HISTORY].store(fp, std::memory_order_relaxed);
+        group->blocks.store(n + 1, std::memory_order_release);
+        ctx->share_matches = 0;
+        ctx->following.store(false, std::memory_order_release);
+        return false;
+    }
+
+    /* Hosts may run the leader before or after us in a cycle, so also
+     * accept our previous block against its history */
+    bool match = false;
+    for (int i = 0; i < SHARE_HISTORY && !match; i++) {
+        uint64_t f = group->fingerprints[i].load(std::memory_order_relaxed);
+        match = f == fp || f == prev_fp;
+    }
+    if (!match) {
+        ctx->share_matches = 0;
+    } else if (ctx->share_matches < SHARE_FOLLOW_BLOCKS) {
+        ctx->share_matches++;
+    }
+
+    bool follow = ctx->share_matches >= SHARE_FOLLOW_BLOCKS;
+    ctx->following.store(follow, std::memory_order_release);
+    return follow;
+}
+
+/* Take ctx out of its share group.  Called with g_pool.lock held. */
+static void share_leave_locked(kd_context *ctx) {
+    kd_share_group *group = ctx->share.load(std::memory_order_relaxed);
+    if (!group) return;
+
+    ctx->following.store(false, std::memory_order_release);
+    ctx->share.store(NULL, std::memory_order_release);
+    kd_context *self = ctx;
+    group->leader.compare_exchange_strong(self, NULL, std::memory_order_acq_rel);
+    if (--group->members == 0) group->name[0] = '\0';
+}
+
+/* Would any of this block open the silence gate?  Decides when kd_feed
+ * first asks for the context's buffers. */
+static bool block_is_loud(kd_context *ctx, const int16_t *stereo_audio, int frames) {
+    float gate_power = ctx->gate_power.load(std::memory_order_relaxed);
+    if (gate_power <= 0.0f) return true;
+
+    float mono[FEED_CHUNK];
+    for (int start = 0; start < frames; start += FEED_CHUNK) {
+        int n = frames - start;
+        if (n > FEED_CHUNK) n = FEED_CHUNK;
+        kd_downmix_s16(stereo_audio + start * 2, n, mono);
+        if (chunk_is_loud(mono, n, gate_power)) return true;
+    }
+    return false;
+}
+
+/* kd_feed's per-chunk work: downmix, gate, resample, write the ring.
+ * FIXED is the specialised path for FEED_CHUNK frames at FIXED_FACTOR
+ * times the analysis rate (one whole chunk, decimator phase 0), where the
+ * chunk size, output count and filter are all compile-time constants.
+ * Returns the new ring_write. */
+template <bool FIXED>
+static uint32_t feed_chunks(kd_context *ctx, kd_buffers *bufs, const int16_t *stereo_audio,
+                            int frames, uint32_t w, bool *gated_out) {
+    if (FIXED) frames = FEED_CHUNK;
+    float gate_power = ctx->gate_power.load(std::memory_order_relaxed);
+    bool gated = *gated_out;
+
+    float mono[FEED_CHUNK];
+    /* Resampler output bound: MIN_INPUT_RATE upsamples by < 1.4x */
+    float decimated[FEED_CHUNK * 2];
+
+    for (int start = 0; start < frames; start += FEED_CHUNK) {
+        int n = frames - start;
+        if (n > FEED_CHUNK) n = FEED_CHUNK;
+
+        /* Downmix to mono float (SIMD kernel in kd_resampler.h) */
+        kd_downmix_s16(stereo_audio + start * 2, n, mono);
+
+        /* Skip near-silence before it costs resampling or analysis */
+        if (gate_power > 0.0f) {
+            if (chunk_is_loud(mono, n, gate_power)) {
+                ctx->gate_quiet = 0;
+            } else if (ctx->gate_quiet < ctx->gate_hold) {
+                ctx->gate_quiet += n;
+            }
+            if (ctx->gate_quiet >= ctx->gate_hold) {
+                gated = true;
+                continue;
+            }
+        }
+        gated = false;
+
+        int out_n;
+        if (FIXED) {
+            kd_decimator_process_fixed<FIXED_FACTOR, FEED_CHUNK>(&ctx->resampler.decim,
+                                                                 mono, decimated);
+            out_n = FEED_CHUNK / FIXED_FACTOR;
+        } else {
+            out_n = kd_resampler_process(&ctx->resampler, mono, n, decimated);
+        }
+
+        /* Never overwrite samples the analysis thread hasn't consumed.
+         * The worker skips its own backlog long before this, so a full ring
+         * means it is stalled outright; count what we lose. */
+        uint32_t used = w - ctx->ring_read.load(std::memory_order_acquire);
+        if (used + (uint32_t)out_n > RING_SAMPLES) {
+            ctx->drop_accum += out_n;
+            if (ctx->drop_accum >= ctx->feed_hop_samples) {
+                ctx->drop_accum -= ctx->feed_hop_samples;
+                uint32_t d = ctx->windows_dropped.load(std::memory_order_relaxed);
+                ctx->windows_dropped.store(d + 1, std::memory_order_relaxed);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < out_n; i++) {
+            bufs->ring[(w + i) & RING_MASK] = decimated[i];
+        }
+        w += out_n;
+    }
+
+    *gated_out = gated;
+    return w;
+}
+
+/* Claim the context's pool slot on the calling thread like a pool thread
+ * would, waiting out one that is mid-analysis, so the two never overlap. */
+static void claim_slot(kd_context *ctx) {
+    int expected = 0;
+    while (!g_pool.slot_busy[ctx->pool_slot].compare_exchange_weak(expected, 1,
+                                                                   std::memory_order_acquire)) {
+        expected = 0;
+        sched_yield();
+    }
+}
+
+static void release_slot(kd_context *ctx) {
+    g_pool.slot_busy[ctx->pool_slot].store(0, std::memory_order_seq_cst);
+}
+
+/* Run the worker's analysis for ctx on the calling thread */
+static void analyze_inline(kd_context *ctx) {
+    claim_slot(ctx);
+
+    warm_kernels();
+    g_pool.queued[ctx->pool_slot].store(false, std::memory_order_relaxed);
+    analyze_pending(ctx, shared_keyfinder());
+
+    release_slot(ctx);
 }
 
 extern "C" {
 
 void* kd_create(int sample_rate) {
+    return kd_create_ex(sample_rate, 0);
+}
+
+void* kd_create_ex(int sample_rate, int block_frames) {
+    if (sample_rate < MIN_INPUT_RATE || sample_rate > MAX_INPUT_RATE) return NULL;
+
     kd_context *ctx = new (std::nothrow) kd_context();
     if (!ctx) return NULL;
 
+    if (!kd_resampler_init(&ctx->resampler, sample_rate, ANALYSIS_RATE)) {
+        delete ctx;
+        return NULL;
+    }
+    /* The rings and workspaces come later, from the pool (see kd_buffers) */
+    ctx->bufs.store(NULL, std::memory_order_relaxed);
+    ctx->want_bufs.store(false, std::memory_order_relaxed);
+
     ctx->sample_rate = sample_rate;
-    ctx->window_seconds = 2.0f;
-    ctx->window_samples = (int)(ctx->window_seconds * EFFECTIVE_RATE);
-    ctx->active_buf.store(0, std::memory_order_relaxed);
-    ctx->write_pos = 0;
-    ctx->downsample_counter = 0;
-    ctx->ready_buf.store(-1, std::memory_order_relaxed);
-    ctx->ready_len.store(0, std::memory_order_relaxed);
-    ctx->shutdown.store(false, std::memory_order_relaxed);
+    /* The resampler picked the decimator for this rate; take its fully
+     * specialised form when the host's block is the one it's built for */
+    ctx->fixed_feed = sample_rate == FIXED_FACTOR * ANALYSIS_RATE &&
+                      block_frames == FEED_CHUNK &&
+                      ctx->resampler.kind == KD_RESAMPLE_DECIMATE;
+    ctx->window_seconds.store(2.0f, std::memory_order_relaxed);
+    ctx->hop_seconds.store(1.0f, std::memory_order_relaxed);
+    ctx->window_samples = 2 * ANALYSIS_RATE;
+    ctx->hop_samples = ANALYSIS_RATE;
+    ctx->feed_hop_samples = ctx->hop_samples;
+    ctx->config_fed = pack_config(ctx->window_samples, ctx->hop_samples);
+    ctx->config_applied = ctx->config_fed;
+    ctx->config_request.store(ctx->config_fed, std::memory_order_relaxed);
+    ctx->config_active.store(ctx->config_fed, std::memory_order_relaxed);
+    ctx->ring_write = 0;
+    ctx->publish_mark = 0;
+    ctx->hop_accum = 0;
+    set_stride(ctx, 1);
+    ctx->budget_tokens = 0.0;
+    ctx->sync_request.store(0, std::memory_order_relaxed);
+    ctx->sync_seen = 0;
+    ctx->sync_mark = 0;
+    ctx->sync_span = 0;
+    ctx->sync_since = SYNC_TIMEOUT;
+    ctx->cpu_budget.store(1.0f, std::memory_order_relaxed);
+    ctx->cpu_load.store(0.0f, std::memory_order_relaxed);
+    ctx->ring_published.store(0, std::memory_order_relaxed);
+    ctx->ring_read.store(0, std::memory_order_relaxed);
+    ctx->windows_analyzed.store(0, std::memory_order_relaxed);
+    ctx->windows_coalesced.store(0, std::memory_order_relaxed);
+    ctx->windows_dropped.store(0, std::memory_order_relaxed);
+    ctx->drop_accum = 0;
+    ctx->gate_hold = (int)(GATE_HOLD_SECONDS * sample_rate);
+    ctx->gate_quiet = ctx->gate_hold;   /* start closed until signal arrives */
+    ctx->gated.store(true, std::memory_order_relaxed);
+    kd_set_gate(ctx, GATE_DEFAULT_DB);
+    ctx->chroma_head = 0;
+    ctx->chroma_count = 0;
+    ctx->chroma_bands = 0;
+    ctx->engine.store(KD_ENGINE_KEYFINDER, std::memory_order_relaxed);
+    ctx->engine_active = KD_ENGINE_KEYFINDER;
+    for (int h = 0; h < KD_NUM_HORIZONS; h++) ctx->horizon_keys[h] = -1;
+    std::memset(ctx->session_chroma, 0, sizeof(ctx->session_chroma));
+    ctx->session_frames = 0;
+    ctx->session_reset.store(false, std::memory_order_relaxed);
     std::memset(ctx->votes, 0, sizeof(ctx->votes));
-    std::strcpy(ctx->detected_key, "---");
+    cell_reset(&ctx->result);
+    ctx->share.store(NULL, std::memory_order_relaxed);
+    ctx->share_fp = 0;
+    ctx->share_blocks_seen = 0;
+    ctx->share_stall = 0;
+    ctx->share_matches = 0;
+    ctx->following.store(false, std::memory_order_relaxed);
+    latency_reset(&ctx->feed_latency);
+    latency_reset(&ctx->chroma_latency);
+    latency_reset(&ctx->estimate_latency);
+    ctx->result_time.store(0, std::memory_order_relaxed);
+    ctx->key_time.store(0, std::memory_order_relaxed);
+    ctx->stats_log.store(NULL, std::memory_order_relaxed);
+    ctx->stats_log_interval.store(0.0f, std::memory_order_relaxed);
+    ctx->stats_logged = 0;
 
-    ctx->worker = std::thread(analysis_thread_fn, ctx);
+    if (!pool_attach(ctx)) {
+        kd_resampler_free(&ctx->resampler);
+        delete ctx;
+        return NULL;
+    }
 
     return ctx;
 }
@@ -159,81 +1751,436 @@ void kd_destroy(void *ptr) {
     kd_context *ctx = (kd_context*)ptr;
     if (!ctx) return;
 
-    ctx->shutdown.store(true, std::memory_order_relaxed);
-    if (ctx->worker.joinable()) {
-        ctx->worker.join();
-    }
-
-    delete ctx;
+    /* The pool frees the context once no thread can be using it */
+    std::lock_guard<std::mutex> guard(g_pool.lock);
+    share_leave_locked(ctx);
+    pool_detach_locked(ctx);
 }
 
 void kd_feed(void *ptr, const int16_t *stereo_audio, int frames) {
     kd_context *ctx = (kd_context*)ptr;
     if (!ctx || !stereo_audio || frames <= 0) return;
+    uint64_t feed_start = monotonic_ns();
 
-    int buf_idx = ctx->active_buf.load(std::memory_order_relaxed);
-    double *buf = ctx->bufs[buf_idx];
-    int pos = ctx->write_pos;
-
-    for (int i = 0; i < frames; i++) {
-        /* Simple decimation: take every Nth sample */
-        if (ctx->downsample_counter == 0) {
-            double left  = stereo_audio[i * 2]     / 32768.0;
-            double right = stereo_audio[i * 2 + 1] / 32768.0;
-            buf[pos] = (left + right) * 0.5;
-            pos++;
-
-            /* Check if we've filled a window */
-            if (pos >= ctx->window_samples) {
-                /* Hand off: only if analysis thread is idle */
-                if (ctx->ready_buf.load(std::memory_order_relaxed) < 0) {
-                    ctx->ready_len.store(pos, std::memory_order_relaxed);
-                    ctx->ready_buf.store(buf_idx, std::memory_order_release);
-                    /* Swap to other buffer — zero copy */
-                    buf_idx = 1 - buf_idx;
-                    ctx->active_buf.store(buf_idx, std::memory_order_relaxed);
-                    buf = ctx->bufs[buf_idx];
-                }
-                pos = 0;
-            }
+    /* Parameter changes take effect here, at a block boundary; if one
+     * did, let the worker re-estimate now */
+    bool kick = take_config(ctx);
+
+    /* In a share group, skip blocks the group leader is analysing for us */
+    kd_share_group *group = ctx->share.load(std::memory_order_acquire);
+    if (group && share_block(ctx, group, stereo_audio, frames)) {
+        latency_add(&ctx->feed_latency, monotonic_ns() - feed_start);
+        return;
+    }
+
+    /* Until the first audio worth analysing, the context has no buffers.
+     * Ask the pool for them then; the blocks fed while it allocates (a
+     * millisecond or so) go unanalysed, as if gated. */
+    kd_buffers *bufs = ctx->bufs.load(std::memory_order_acquire);
+    if (!bufs) {
+        if (ctx->want_bufs.load(std::memory_order_relaxed) ||
+            block_is_loud(ctx, stereo_audio, frames)) {
+            ctx->want_bufs.store(true, std::memory_order_release);
+            pool_kick(ctx);
         }
-        ctx->downsample_counter = (ctx->downsample_counter + 1) % DOWNSAMPLE;
+        latency_add(&ctx->feed_latency, monotonic_ns() - feed_start);
+        return;
+    }
+
+    uint32_t w = ctx->ring_write;
+    bool gated = false;
+    if (ctx->fixed_feed && frames == FEED_CHUNK && ctx->resampler.decim.phase == 0) {
+        w = feed_chunks<true>(ctx, bufs, stereo_audio, FEED_CHUNK, w, &gated);
+    } else {
+        w = feed_chunks<false>(ctx, bufs, stereo_audio, frames, w, &gated);
     }
 
-    ctx->write_pos = pos;
+    ctx->ring_write = w;
+    ctx->gated.store(gated, std::memory_order_relaxed);
+
+    /* Publish every chroma hop, then queue the context with the pool
+     * unless it is already queued (try-post) */
+    if ((int)(w - ctx->publish_mark) >= CHROMA_HOP) {
+        ctx->publish_mark = w;
+        ctx->ring_published.store(w, std::memory_order_release);
+        kick = true;
+    }
+    if (kick) pool_kick(ctx);
+    latency_add(&ctx->feed_latency, monotonic_ns() - feed_start);
+}
+
+void kd_sync_boundary(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return;
+
+    /* Count starts at 1 so the worker can tell "no boundary yet" apart */
+    uint64_t req = ctx->sync_request.load(std::memory_order_relaxed);
+    uint32_t count = (uint32_t)(req >> 32) + 1;
+    if (count == 0) count = 1;
+    ctx->sync_request.store(((uint64_t)count << 32) | ctx->ring_write,
+                            std::memory_order_release);
+}
+
+void kd_flush(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return;
+
+    /* Publish everything fed so far, including a partial hop.  Only whole
+     * chroma hops can be analysed; a shorter tail waits for more audio. */
+    take_config(ctx);
+    ctx->publish_mark = ctx->ring_write;
+    ctx->ring_published.store(ctx->ring_write, std::memory_order_release);
+    analyze_inline(ctx);
+}
+
+int kd_analyze_buffer(void *ptr, const int16_t *stereo_audio, int frames, kd_result *out) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx || !stereo_audio || frames < 0) return 0;
+
+    /* Feed a chroma hop at a time and analyse it right away.  The ring
+     * never backs up (no skipped or dropped audio), a pass is shorter than
+     * the shortest hop so no estimate is ever coalesced, and the outcome
+     * doesn't depend on thread timing.  The buffers are allocated up
+     * front, so no leading audio is lost waiting for them. */
+    ctx->want_bufs.store(true, std::memory_order_release);
+    analyze_inline(ctx);
+
+    int pass = (int)((int64_t)CHROMA_HOP * ctx->sample_rate / ANALYSIS_RATE);
+    if (pass < 1) pass = 1;
+    for (int pos = 0; pos < frames; pos += pass) {
+        int n = frames - pos;
+        if (n > pass) n = pass;
+        kd_feed(ctx, stereo_audio + (size_t)pos * 2, n);
+        kd_flush(ctx);
+    }
+    kd_flush(ctx);
+
+    /* Read the result with the slot held, so a pool pass kicked by kd_feed
+     * can't be publishing over it.  The cell can still be mid-write by a
+     * share group leader; that's brief, so keep trying rather than give
+     * up after RESULT_READ_TRIES as kd_get_result does. */
+    kd_result r;
+    claim_slot(ctx);
+    while (!cell_read(current_cell(ctx), &r)) sched_yield();
+    release_slot(ctx);
+
+    if (out) *out = r;
+    return r.seq > 0 ? 1 : 0;
+}
+
+void kd_set_engine(void *ptr, int engine) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx || engine < KD_ENGINE_KEYFINDER || engine > KD_ENGINE_TEMPERLEY) return;
+    if (engine != KD_ENGINE_KEYFINDER) lite_tables();   /* build them here, not on the pool */
+    ctx->engine.store(engine, std::memory_order_relaxed);
+
+    /* Let the worker switch now rather than at the next hop */
+    pool_kick(ctx);
+}
+
+int kd_get_engine(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    return ctx ? ctx->engine.load(std::memory_order_relaxed) : KD_ENGINE_KEYFINDER;
+}
+
+void kd_reset_session(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return;
+    ctx->session_reset.store(true, std::memory_order_release);
+}
+
+int kd_get_key_horizon(void *ptr, int horizon, char *buf, int buf_len) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx || !buf || buf_len <= 0 || horizon < 0 || horizon >= KD_NUM_HORIZONS) return 0;
+
+    const char *name = kd_key_name(
+        current_cell(ctx)->horizon_keys[horizon].load(std::memory_order_relaxed));
+    int len = std::strlen(name);
+    if (len >= buf_len) len = buf_len - 1;
+    std::memcpy(buf, name, len);
+    buf[len] = '\0';
+    return len;
 }
 
 int kd_get_key(void *ptr, char *buf, int buf_len) {
     kd_context *ctx = (kd_context*)ptr;
     if (!ctx || !buf || buf_len <= 0) return 0;
 
-    int len = std::strlen(ctx->detected_key);
+    /* key is a single atomic, so it never needs the seqlock retry */
+    const char *name = kd_key_name(current_cell(ctx)->key.load(std::memory_order_relaxed));
+    int len = std::strlen(name);
     if (len >= buf_len) len = buf_len - 1;
-    std::memcpy(buf, ctx->detected_key, len);
+    std::memcpy(buf, name, len);
     buf[len] = '\0';
     return len;
 }
 
+uint32_t kd_get_result_seq(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return 0;
+    return current_cell(ctx)->seq.load(std::memory_order_acquire) >> 1;
+}
+
+int kd_get_result(void *ptr, kd_result *out) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx || !out) return 0;
+
+    return cell_read(current_cell(ctx), out) ? 1 : 0;
+}
+
+uint32_t kd_get_key_change_seq(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return 0;
+    return current_cell(ctx)->changes.load(std::memory_order_acquire);
+}
+
+int kd_get_key_changes(void *ptr, uint32_t after, kd_key_change *out, int max) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx || !out || max <= 0) return 0;
+    return changes_read(current_cell(ctx), after, out, max);
+}
+
+const char* kd_key_name(int key) {
+    if (key < 0 || key >= KD_NUM_KEYS) return key_names[KeyFinder::SILENCE];
+    return key_names[key];
+}
+
 void kd_set_window(void *ptr, float seconds) {
     kd_context *ctx = (kd_context*)ptr;
     if (!ctx) return;
 
     if (seconds < 1.0f) seconds = 1.0f;
-    if (seconds > 8.0f) seconds = 8.0f;
+    if (seconds > (float)MAX_WINDOW_SECONDS) seconds = (float)MAX_WINDOW_SECONDS;
 
-    ctx->window_seconds = seconds;
-    ctx->window_samples = (int)(seconds * EFFECTIVE_RATE);
-    ctx->write_pos = 0;
-    ctx->downsample_counter = 0;
-    ctx->ready_buf.store(-1, std::memory_order_relaxed);
-    std::memset(ctx->votes, 0, sizeof(ctx->votes));
-    std::strcpy(ctx->detected_key, "---");
+    float hop = ctx->hop_seconds.load(std::memory_order_relaxed);
+    if (hop > seconds) hop = seconds;
+
+    ctx->window_seconds.store(seconds, std::memory_order_relaxed);
+    ctx->hop_seconds.store(hop, std::memory_order_relaxed);
+    ctx->config_request.store(pack_config((int)(seconds * ANALYSIS_RATE),
+                                          (int)(hop * ANALYSIS_RATE)),
+                              std::memory_order_release);
+}
+
+void kd_set_cache_dir(const char *dir) {
+    std::lock_guard<std::mutex> guard(g_pool.lock);
+    if (!dir) dir = "";
+    std::strncpy(g_cache_dir, dir, sizeof(g_cache_dir) - 1);
+    g_cache_dir[sizeof(g_cache_dir) - 1] = '\0';
+}
+
+int kd_set_scheduling(int policy, uint64_t cpu_mask, int slice_us) {
+    if (policy != KD_SCHED_NICE && policy != KD_SCHED_BATCH && policy != KD_SCHED_IDLE) return -1;
+#if defined(__linux__)
+    /* The mask must leave at least one CPU we have */
+    int cores = (int)std::thread::hardware_concurrency();
+    if (cpu_mask && cores > 0 && cores < 64 && !(cpu_mask & ((1ull << cores) - 1))) return -1;
+#else
+    if (policy != KD_SCHED_NICE || cpu_mask) return -1;
+#endif
+    if (slice_us < 0) slice_us = 0;
+
+    std::lock_guard<std::mutex> guard(g_pool.lock);
+    g_sched.policy.store(policy, std::memory_order_relaxed);
+    g_sched.cpu_mask.store(cpu_mask, std::memory_order_relaxed);
+    g_sched.slice_us.store(slice_us, std::memory_order_relaxed);
+    g_sched.gen.fetch_add(1, std::memory_order_release);
+
+    /* Wake every thread so the change lands now rather than on the next
+     * published chunk; a wakeup with nothing queued is a no-op scan. */
+    for (int i = 0; i < g_pool.nthreads; i++) kd_sem_post(&g_pool.wake);
+    return 0;
+}
+
+float kd_get_max_run_ms(void) {
+    return g_sched.max_run_us.exchange(0, std::memory_order_relaxed) / 1000.0f;
 }
 
 float kd_get_window(void *ptr) {
     kd_context *ctx = (kd_context*)ptr;
     if (!ctx) return 2.0f;
-    return ctx->window_seconds;
+    return ctx->window_seconds.load(std::memory_order_relaxed);
+}
+
+void kd_set_hop(void *ptr, float seconds) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return;
+
+    float window = ctx->window_seconds.load(std::memory_order_relaxed);
+    if (seconds < MIN_HOP_SECONDS) seconds = MIN_HOP_SECONDS;
+    if (seconds > window) seconds = window;
+
+    ctx->hop_seconds.store(seconds, std::memory_order_relaxed);
+    ctx->config_request.store(pack_config((int)(window * ANALYSIS_RATE),
+                                          (int)(seconds * ANALYSIS_RATE)),
+                              std::memory_order_release);
+}
+
+float kd_get_hop(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return 1.0f;
+    return ctx->hop_seconds.load(std::memory_order_relaxed);
+}
+
+void kd_set_gate(void *ptr, float threshold_db) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return;
+
+    if (threshold_db < GATE_OFF_DB) threshold_db = GATE_OFF_DB;
+    if (threshold_db > 0.0f) threshold_db = 0.0f;
+
+    ctx->gate_db.store(threshold_db, std::memory_order_relaxed);
+    ctx->gate_power.store(threshold_db <= GATE_OFF_DB ? 0.0f
+                                                      : std::pow(10.0f, threshold_db / 10.0f),
+                          std::memory_order_relaxed);
+}
+
+float kd_get_gate(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return GATE_DEFAULT_DB;
+    return ctx->gate_db.load(std::memory_order_relaxed);
+}
+
+int kd_is_gated(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return 0;
+    return ctx->gated.load(std::memory_order_relaxed) ? 1 : 0;
+}
+
+void kd_set_cpu_budget(void *ptr, float percent) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return;
+
+    if (percent < 1.0f) percent = 1.0f;
+    if (percent > 100.0f) percent = 100.0f;
+    ctx->cpu_budget.store(percent / 100.0f, std::memory_order_relaxed);
+}
+
+float kd_get_cpu_budget(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return 100.0f;
+    return ctx->cpu_budget.load(std::memory_order_relaxed) * 100.0f;
+}
+
+void kd_get_load(void *ptr, float *cpu_percent, int *stride) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (cpu_percent) *cpu_percent = ctx ? ctx->cpu_load.load(std::memory_order_relaxed) * 100.0f : 0.0f;
+    if (stride)      *stride      = ctx ? ctx->stride_shown.load(std::memory_order_relaxed) : 1;
+}
+
+void kd_get_window_counts(void *ptr, uint32_t *analyzed, uint32_t *coalesced,
+                          uint32_t *dropped) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (analyzed)  *analyzed  = ctx ? ctx->windows_analyzed.load(std::memory_order_relaxed) : 0;
+    if (coalesced) *coalesced = ctx ? ctx->windows_coalesced.load(std::memory_order_relaxed) : 0;
+    if (dropped)   *dropped   = ctx ? ctx->windows_dropped.load(std::memory_order_relaxed) : 0;
+}
+
+int kd_set_share_group(void *ptr, const char *name) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return -1;
+
+    std::lock_guard<std::mutex> guard(g_pool.lock);
+    kd_share_group *current = ctx->share.load(std::memory_order_relaxed);
+    if (current && name && std::strncmp(current->name, name, SHARE_NAME_LEN - 1) == 0) return 0;
+    share_leave_locked(ctx);
+    if (!name || !name[0]) return 0;
+
+    kd_share_group *group = NULL;
+    for (int i = 0; i < SHARE_GROUPS && !group; i++) {
+        if (g_groups[i].name[0] && std::strncmp(g_groups[i].name, name, SHARE_NAME_LEN - 1) == 0) {
+            group = &g_groups[i];
+        }
+    }
+    for (int i = 0; i < SHARE_GROUPS && !group; i++) {
+        if (g_groups[i].name[0]) continue;
+        group = &g_groups[i];
+        std::strncpy(group->name, name, SHARE_NAME_LEN - 1);
+        group->name[SHARE_NAME_LEN - 1] = '\0';
+        group->members = 0;
+        group->leader.store(NULL, std::memory_order_relaxed);
+        for (int f = 0; f < SHARE_HISTORY; f++) {
+            group->fingerprints[f].store(0, std::memory_order_relaxed);
+        }
+        cell_reset(&group->result);
+    }
+    if (!group) return -1;
+
+    group->members++;
+    ctx->share_blocks_seen = group->blocks.load(std::memory_order_relaxed);
+    ctx->share_stall = 0;
+    ctx->share_matches = 0;
+    ctx->share.store(group, std::memory_order_release);
+    return 0;
+}
+
+int kd_is_following(void *ptr) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return 0;
+    return ctx->following.load(std::memory_order_relaxed) ? 1 : 0;
+}
+
+void kd_get_stats(void *ptr, kd_stats *out) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!out) return;
+    std::memset(out, 0, sizeof(*out));
+    out->result_age_ms = -1.0f;
+    out->key_age_ms = -1.0f;
+    if (!ctx) return;
+
+    latency_read(&ctx->feed_latency, &out->feed);
+    latency_read(&ctx->chroma_latency, &out->chroma);
+    latency_read(&ctx->estimate_latency, &out->estimate);
+    kd_get_window_counts(ctx, &out->analyzed, &out->coalesced, &out->dropped);
+
+    uint64_t now = monotonic_ns();
+    uint64_t result_time = ctx->result_time.load(std::memory_order_relaxed);
+    uint64_t key_time = ctx->key_time.load(std::memory_order_relaxed);
+    if (result_time && now >= result_time) out->result_age_ms = (now - result_time) / 1e6f;
+    if (key_time && now >= key_time) out->key_age_ms = (now - key_time) / 1e6f;
+}
+
+/* Append one histogram as {"n":..,"mean_us":..,"max_us":..,"h":[..]} */
+static int format_latency(char *buf, int buf_len, const char *name, const kd_latency *l) {
+    int last = KD_HIST_BUCKETS - 1;
+    while (last >= 0 && l->buckets[last] == 0) last--;
+
+    int len = snprintf(buf, buf_len, "\"%s\":{\"n\":%llu,\"mean_us\":%.1f,\"max_us\":%.1f,\"h\":[",
+                       name, (unsigned long long)l->count, l->mean_us, l->max_us);
+    for (int b = 0; b <= last && len < buf_len; b++) {
+        len += snprintf(buf + len, buf_len - len, "%s%u", b ? "," : "", (unsigned)l->buckets[b]);
+    }
+    if (len < buf_len) len += snprintf(buf + len, buf_len - len, "]}");
+    return len;
+}
+
+int kd_format_stats(void *ctx, char *buf, int buf_len) {
+    if (!buf || buf_len <= 0) return -1;
+    kd_stats s;
+    kd_get_stats(ctx, &s);
+
+    int len = snprintf(buf, buf_len, "{");
+    if (len < buf_len) len += format_latency(buf + len, buf_len - len, "feed", &s.feed);
+    if (len < buf_len) len += snprintf(buf + len, buf_len - len, ",");
+    if (len < buf_len) len += format_latency(buf + len, buf_len - len, "chroma", &s.chroma);
+    if (len < buf_len) len += snprintf(buf + len, buf_len - len, ",");
+    if (len < buf_len) len += format_latency(buf + len, buf_len - len, "estimate", &s.estimate);
+    if (len < buf_len) {
+        len += snprintf(buf + len, buf_len - len,
+                        ",\"analyzed\":%u,\"coalesced\":%u,\"dropped\":%u,"
+                        "\"result_age_ms\":%.0f,\"key_age_ms\":%.0f}",
+                        (unsigned)s.analyzed, (unsigned)s.coalesced, (unsigned)s.dropped,
+                        s.result_age_ms, s.key_age_ms);
+    }
+    return len < buf_len ? len : -1;
+}
+
+void kd_set_stats_log(void *ptr, void (*log)(const char *msg), float interval_seconds) {
+    kd_context *ctx = (kd_context*)ptr;
+    if (!ctx) return;
+    if (interval_seconds < 0.0f) interval_seconds = 0.0f;
+    ctx->stats_log_interval.store(interval_seconds, std::memory_order_relaxed);
+    ctx->stats_log.store(interval_seconds > 0.0f ? log : NULL, std::memory_order_release);
 }
 
 } /* extern "C" */
@@ -15,31 +15,275 @@ extern "C" {
 #endif
 
 /* Create a key detection context.
- * sample_rate: audio sample rate (e.g. 44100)
+ * sample_rate: audio sample rate (e.g. 44100), 8000 - 384000 Hz.
+ *   Input is resampled to a fixed internal analysis rate.
+ * Cheap: the analysis buffers (~300 KB) are allocated in the background
+ * when the first audio above the silence gate is fed, so a patch full of
+ * instances that never see signal never allocates them.
  * Returns opaque context pointer, or NULL on failure. */
 void* kd_create(int sample_rate);
 
-/* Destroy a key detection context and free all resources. */
+/* As kd_create, for a host that always feeds block_frames frames per
+ * kd_feed call (0 = varies).  128 frames at 44100 Hz (Move) selects a feed
+ * path specialised at compile time for exactly that block; other blocks
+ * still work and take the generic path. */
+void* kd_create_ex(int sample_rate, int block_frames);
+
+/* Destroy a key detection context and free all resources.  Doesn't wait
+ * for analysis in progress: the analysis threads free the context once
+ * they're done with it.  Destroying the last context stops those threads,
+ * which waits only for a pass already under way. */
 void kd_destroy(void *ctx);
 
+/* Set a directory for process-wide analysis caches (call before the first
+ * kd_create).  When built with KD_FFTW_WISDOM, FFTW wisdom is loaded from
+ * it when analysis starts and saved when the last context is destroyed. */
+void kd_set_cache_dir(const char *dir);
+
+/* Scheduling policies for the shared analysis threads */
+#define KD_SCHED_NICE  0   /* normal time-sharing at nice 10 (default) */
+#define KD_SCHED_BATCH 1   /* SCHED_BATCH: never preempts on wakeup */
+#define KD_SCHED_IDLE  2   /* SCHED_IDLE: runs only when a CPU is otherwise idle */
+
+/* Set how the process-wide analysis threads are scheduled.  May be called
+ * at any time; each thread picks the change up at its next wakeup.
+ * policy:   KD_SCHED_NICE, KD_SCHED_BATCH or KD_SCHED_IDLE (Linux only)
+ * cpu_mask: CPUs the threads may run on, bit n = CPU n, 0 = any.  Leave
+ *           out the audio thread's core (Linux only).
+ * slice_us: if > 0, analysis yields the CPU between FFT frames once it has
+ *           run this long, so a thread catching up on a backlog hands the
+ *           core back every slice instead of holding it for the whole pass.
+ *           0 = run each pass to completion.
+ * Returns 0, or -1 if the policy or mask can't be used here. */
+int kd_set_scheduling(int policy, uint64_t cpu_mask, int slice_us);
+
+/* Longest run of analysis CPU time between yields, in milliseconds, since
+ * the previous call (which it resets).  With slicing on this stays near
+ * slice_us plus one FFT frame; it bounds the analysis threads' worst-case
+ * hold on a core shared with audio. */
+float kd_get_max_run_ms(void);
+
 /* Feed stereo interleaved int16 audio for analysis.
  * The audio is downmixed to mono internally.
- * When enough audio has been accumulated (>= window size),
- * analysis runs automatically. */
+ * New audio is turned into chroma in the background every hop and the
+ * key is re-estimated over the last window of chroma.  The first blocks
+ * above the silence gate (about a millisecond's worth) go unanalysed
+ * while the analysis buffers are allocated. */
 void kd_feed(void *ctx, const int16_t *stereo_audio, int frames);
 
+/* Mark a musical boundary (e.g. a bar line from MIDI clock) at the current
+ * end of the fed audio.  Call from the same thread as kd_feed.  While
+ * boundaries keep arriving (up to 18 s apart), the key is estimated once
+ * per boundary over the audio since the previous one, or its last 16 s if
+ * longer (4 bars below 60 BPM), instead of every hop over the window; if
+ * they stop for 2 s longer than the last span, the hop schedule resumes. */
+void kd_sync_boundary(void *ctx);
+
 /* Get the currently detected key as a human-readable string.
  * Returns bytes written (excluding NUL), or 0 if no key detected yet.
  * Example output: "Eb min", "A maj", "---" */
 int kd_get_key(void *ctx, char *buf, int buf_len);
 
+#define KD_NUM_KEYS 24
+
+/* Key horizons, all classified from the same chroma at each estimate */
+#define KD_HORIZON_FAST    0   /* newest chroma frame (~1.5 s): responsive, jumpy */
+#define KD_HORIZON_WINDOW  1   /* the voted window estimate (same as key) */
+#define KD_HORIZON_LONG    2   /* last 16 s */
+#define KD_HORIZON_SESSION 3   /* everything since kd_create or kd_reset_session */
+#define KD_NUM_HORIZONS    4
+
+/* Snapshot of the latest key estimate.
+ * Keys are indexed in libkeyfinder order: 0 = A maj, 1 = A min,
+ * 2 = Bb maj, ... 23 = Ab min (see kd_key_name). */
+typedef struct {
+    uint32_t seq;               /* estimates published so far; 0 = none yet */
+    int key;                    /* winning key index, or -1 if none yet */
+    float confidence;           /* winner's share of all votes, 0 - 1 */
+    float margin;               /* (winner - runner-up) share of all votes, 0 - 1 */
+    float scores[KD_NUM_KEYS];  /* decayed vote weight per key */
+    int horizon_keys[KD_NUM_HORIZONS]; /* key per KD_HORIZON_*, -1 if none yet */
+} kd_result;
+
+/* Sequence number of the latest published result.  A single atomic load,
+ * so the audio thread can poll it every block and only call
+ * kd_get_result when it changes. */
+uint32_t kd_get_result_seq(void *ctx);
+
+/* Copy the latest result into *out.  Lock-free and safe from any thread;
+ * never blocks the analysis thread.  Returns 1 on success, or 0 (leaving
+ * *out untouched) if a consistent copy could not be taken because a
+ * result was being published at that moment; try again next block. */
+int kd_get_result(void *ctx, kd_result *out);
+
+/* A change of the published key, logged by the analysis thread as it
+ * publishes the result that made it */
+typedef struct {
+    uint32_t seq;               /* change number, from 1 */
+    int key;                    /* new key index, 0 - 23 */
+    int prev_key;               /* key it replaced, or -1 for the first */
+    float confidence;           /* new key's confidence, as in kd_result */
+    uint32_t result_seq;        /* kd_result.seq of the result that made it */
+    uint64_t time_ns;           /* when it was published, CLOCK_MONOTONIC */
+} kd_key_change;
+
+#define KD_KEY_CHANGES 16       /* changes kept for kd_get_key_changes */
+
+/* Number of the newest key change, 0 = none yet.  A single atomic load,
+ * so the audio thread can poll it every block, as kd_get_result_seq. */
+uint32_t kd_get_key_change_seq(void *ctx);
+
+/* Copy up to max key changes numbered after `after` (0 = all kept) into
+ * out, oldest first.  Lock-free and safe from any thread.  Only the last
+ * KD_KEY_CHANGES are kept, so a reader further behind than that gets the
+ * oldest still held and sees the gap in seq.  A share group member that
+ * starts or stops following (kd_is_following) switches to the group's
+ * changes, which are numbered separately; an `after` past the newest is
+ * taken as 0.  Returns the number copied. */
+int kd_get_key_changes(void *ctx, uint32_t after, kd_key_change *out, int max);
+
+/* Display name for a key index, e.g. "Eb min"; "---" if out of range. */
+const char* kd_key_name(int key);
+
+/* Get the key for one KD_HORIZON_* as a display string, like kd_get_key. */
+int kd_get_key_horizon(void *ctx, int horizon, char *buf, int buf_len);
+
+/* Start a new session for KD_HORIZON_SESSION (e.g. at a song change).
+ * Takes effect with the next chroma the analysis thread computes. */
+void kd_reset_session(void *ctx);
+
+/* Analyse everything fed so far on the calling thread and return once it
+ * is reflected in the result.  Call from the thread that calls kd_feed.
+ * Audio short of a whole chroma hop (~0.37 s) is kept for later. */
+void kd_flush(void *ctx);
+
+/* Offline analysis: run stereo interleaved int16 audio through the same
+ * resampling, chroma and voting as kd_feed, inline on the calling thread,
+ * at full CPU speed and with reproducible output.  Adds to whatever the
+ * context has already heard.  Fills *out (may be NULL) with the result
+ * for everything analysed and returns 1 if a key has been estimated, 0
+ * otherwise; unlike kd_get_result it never fails on a publish in progress.
+ * Don't call concurrently with kd_feed on the same context. */
+int kd_analyze_buffer(void *ctx, const int16_t *stereo_audio, int frames, kd_result *out);
+
 /* Set the analysis window size in seconds (1.0 - 8.0).
- * Larger windows are more accurate but slower to update. */
+ * Larger windows are more accurate but slower to update.
+ * Safe to call while audio is running: the change is queued and applied
+ * at the start of the next kd_feed.  Recent chroma is kept, so the key is
+ * re-estimated over the new window right away. */
 void kd_set_window(void *ctx, float seconds);
 
 /* Get the current window size in seconds. */
 float kd_get_window(void *ctx);
 
+/* Set how often the key is re-estimated, in seconds (0.5 - window).
+ * Each hop the estimate is refreshed over the last window of audio,
+ * so windows overlap whenever hop < window.  Queued like kd_set_window. */
+void kd_set_hop(void *ctx, float seconds);
+
+/* Get the current hop size in seconds. */
+float kd_get_hop(void *ctx);
+
+/* Set the silence gate threshold in dBFS (-96 - 0, default -60).
+ * Audio whose RMS stays below it for a second is not analysed at all and
+ * the current result is held.  -96 disables the gate. */
+void kd_set_gate(void *ctx, float threshold_db);
+
+/* Get the current gate threshold in dBFS. */
+float kd_get_gate(void *ctx);
+
+/* Returns 1 while the gate is closed (input treated as silence). */
+int kd_is_gated(void *ctx);
+
+/* Cap the CPU spent on analysis, as a percentage of one core (1 - 100,
+ * default 100 = uncapped).  Over budget, chunks of audio are skipped
+ * rather than queued, so the cap costs accuracy, never latency. */
+void kd_set_cpu_budget(void *ctx, float percent);
+
+/* Get the CPU budget in percent of one core. */
+float kd_get_cpu_budget(void *ctx);
+
+/* Get the analysis load (either pointer may be NULL).
+ * cpu_percent: smoothed chroma CPU time per second of audio, in percent
+ * stride:      1 = every chunk analysed; 2 or 4 while the key is stable
+ *              (with libkeyfinder, only while a strided frame fits the window) */
+void kd_get_load(void *ctx, float *cpu_percent, int *stride);
+
+/* Analysis engines */
+#define KD_ENGINE_KEYFINDER 0   /* libkeyfinder chroma and classifier (default) */
+#define KD_ENGINE_KRUMHANSL 1   /* light: 4096-point FFT chroma, Krumhansl-Kessler profiles */
+#define KD_ENGINE_TEMPERLEY 2   /* light: same chroma, Temperley profiles */
+
+/* Select the analysis engine.  The light engines (kd_lite.h) use a small
+ * fraction of libkeyfinder's CPU and memory for somewhat lower accuracy,
+ * weakest on bass-heavy material.  Safe while audio runs: the analysis
+ * thread switches at its next pass and starts the window, votes and
+ * session over on the new engine, keeping the old result until then. */
+void kd_set_engine(void *ctx, int engine);
+
+/* Get the selected engine (KD_ENGINE_*). */
+int kd_get_engine(void *ctx);
+
+/* Get running window counters since kd_create (any pointer may be NULL).
+ * analyzed:  key estimates made
+ * coalesced: hops merged into a later estimate, or skipped, because the
+ *            analysis thread was busy
+ * dropped:   hops of audio lost because the analysis thread stalled
+ * A growing coalesced/dropped count means the detector is CPU-bound. */
+void kd_get_window_counts(void *ctx, uint32_t *analyzed, uint32_t *coalesced,
+                          uint32_t *dropped);
+
+/* Join the named share group (up to 31 characters), or leave it with NULL
+ * or "".  Contexts in a group fingerprint each block they're fed; one
+ * analyses as usual and the others, while their audio matches its, skip
+ * resampling and analysis and report its result instead, so identical
+ * taps (a bus and the master carrying the same signal, a duplicated
+ * chain) are analysed once.  Members should use the same settings: the
+ * shared result is the leader's.  Control thread; safe while audio runs.
+ * Returns 0, or -1 if all 16 groups are taken. */
+int kd_set_share_group(void *ctx, const char *name);
+
+/* Returns 1 while this context is reporting its share group's result. */
+int kd_is_following(void *ctx);
+
+/* Latency histogram buckets: [0] under 1 us, [i] from 2^(i-1) to 2^i us,
+ * [KD_HIST_BUCKETS - 1] everything from ~262 ms up. */
+#define KD_HIST_BUCKETS 20
+
+/* Wall-clock latency of one hot path since kd_create */
+typedef struct {
+    uint64_t count;
+    float mean_us;
+    float max_us;
+    uint32_t buckets[KD_HIST_BUCKETS];
+} kd_latency;
+
+/* Hot-path instrumentation.  Counters are updated with relaxed atomics,
+ * so a snapshot is cheap and never blocks audio, but fields may be from
+ * slightly different moments. */
+typedef struct {
+    kd_latency feed;        /* kd_feed calls (audio thread) */
+    kd_latency chroma;      /* chroma for one chunk of audio (~0.37 s) */
+    kd_latency estimate;    /* classifying a window of chroma into a key */
+    uint32_t analyzed;      /* as kd_get_window_counts */
+    uint32_t coalesced;
+    uint32_t dropped;
+    float result_age_ms;    /* since the last result was published, -1 = none yet */
+    float key_age_ms;       /* since the published key last changed, -1 = none yet */
+} kd_stats;
+
+/* Take a snapshot of the instrumentation. */
+void kd_get_stats(void *ctx, kd_stats *out);
+
+/* Format the snapshot as compact JSON (histograms trimmed after their
+ * last non-empty bucket).  Returns the length, or -1 if buf is too small. */
+int kd_format_stats(void *ctx, char *buf, int buf_len);
+
+/* Log the JSON stats through `log` at most every interval_seconds, from
+ * the analysis thread after it has worked (never from kd_feed).
+ * interval_seconds <= 0 or a NULL log turns it off. */
+void kd_set_stats_log(void *ctx, void (*log)(const char *msg), float interval_seconds);
+
 #ifdef __cplusplus
 }
 #endif
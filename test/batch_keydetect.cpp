@@ -0,0 +1,217 @@
+/*
+ * batch_keydetect.cpp - Parallel offline key analysis for whole libraries
+ *
+ * Streams each WAV (wav_reader.h) through its own wrapper context with
+ * kd_analyze_buffer, so every file gets exactly the resampling, chroma and
+ * voting the plugin applies live, and reports the final result.  Worker
+ * threads take files off a shared counter until the list is used up; each
+ * file is read a block at a time straight from the mapping, so memory
+ * doesn't grow with track length.  Runs flat out: no sleeps, no polling.
+ *
+ * Parallelism is over files only, deliberately.  The wrapper's result is
+ * sequential all the way down (the resampler history and libkeyfinder's
+ * FFT overlap carry from chunk to chunk, and each vote decays the ones
+ * before it), so splitting a file across contexts would give a different
+ * key from the plugin's.  A library keeps every core busy; a single long
+ * mix runs on one core, at many times realtime.
+ * Results stream to stdout (or -o) as CSV or JSON lines.
+ *
+ *   batch_keydetect [-j threads] [-w window_s] [-f csv|jsonl] [-o out]
+ *                   [-l list.txt] [file.wav ...]
+ */
+
+#include "../src/dsp/keyfinder_wrapper.h"
+#include "wav_reader.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <chrono>
+
+#define BLOCK_FRAMES 65536  /* frames read and analysed per call */
+#define MAX_THREADS 32      /* one context each, well inside the wrapper's limit */
+
+/* ---- Jobs ---- */
+
+struct FileJob {
+    std::string path;
+    double seconds = 0.0;
+};
+
+struct Batch {
+    std::vector<FileJob> *jobs = NULL;
+    std::atomic<size_t> next{0};         /* first file not yet taken */
+    float window_seconds = 4.0f;
+    bool jsonl = false;
+    FILE *out = stdout;
+    std::mutex out_lock;
+    std::atomic<int> done{0}, failed{0};
+};
+
+/* ---- Output ---- */
+
+static std::string json_escape(const std::string &s) {
+    std::string r;
+    for (char c : s) {
+        if (c == '"' || c == '\\') { r += '\\'; r += c; }
+        else if ((unsigned char)c < 0x20) { char tmp[8]; snprintf(tmp, sizeof(tmp), "\\u%04x", c); r += tmp; }
+        else r += c;
+    }
+    return r;
+}
+
+static std::string csv_escape(const std::string &s) {
+    if (s.find_first_of(",\"\n") == std::string::npos) return s;
+    std::string r = "\"";
+    for (char c : s) {
+        if (c == '"') r += '"';
+        r += c;
+    }
+    return r + "\"";
+}
+
+static void emit_result(Batch &b, FileJob *job, const kd_result *r, uint32_t windows,
+                        const char *error) {
+    int key = r ? r->key : -1;
+    float confidence = r ? r->confidence : 0.0f;
+
+    std::lock_guard<std::mutex> guard(b.out_lock);
+    if (b.jsonl) {
+        fprintf(b.out, "{\"path\":\"%s\",\"key\":\"%s\",\"key_index\":%d,"
+                "\"confidence\":%.3f,\"windows\":%u,\"seconds\":%.1f",
+                json_escape(job->path).c_str(), kd_key_name(key), key, confidence,
+                windows, job->seconds);
+        if (error) fprintf(b.out, ",\"error\":\"%s\"", json_escape(error).c_str());
+        fprintf(b.out, "}\n");
+    } else {
+        fprintf(b.out, "%s,%s,%d,%.3f,%u,%.1f,%s\n", csv_escape(job->path).c_str(),
+                kd_key_name(key), key, confidence, windows, job->seconds,
+                error ? error : "");
+    }
+    fflush(b.out);
+}
+
+/* ---- Work ---- */
+
+static void run_file(Batch &b, FileJob *job, int16_t *block) {
+    wav_reader wav;
+    if (!wav_open(&wav, job->path.c_str())) {
+        b.failed++;
+        emit_result(b, job, NULL, 0, "cannot read WAV");
+        return;
+    }
+    job->seconds = (double)wav.frames / wav.sample_rate;
+
+    void *kd = kd_create(wav.sample_rate);
+    if (!kd) {
+        wav_close(&wav);
+        b.failed++;
+        emit_result(b, job, NULL, 0, "unsupported sample rate");
+        return;
+    }
+    kd_set_window(kd, b.window_seconds);
+
+    kd_result result = {};
+    int have_key = 0;
+    int n;
+    while ((n = wav_read_s16_stereo(&wav, block, BLOCK_FRAMES)) > 0) {
+        have_key = kd_analyze_buffer(kd, block, n, &result);
+    }
+    uint32_t windows = 0;
+    kd_get_window_counts(kd, &windows, NULL, NULL);
+
+    kd_destroy(kd);
+    wav_close(&wav);
+    emit_result(b, job, have_key ? &result : NULL, windows, NULL);
+    b.done++;
+}
+
+static void worker_fn(Batch *b) {
+    std::vector<int16_t> block((size_t)BLOCK_FRAMES * 2);
+    size_t i;
+    while ((i = b->next.fetch_add(1, std::memory_order_relaxed)) < b->jobs->size()) {
+        run_file(*b, &(*b->jobs)[i], block.data());
+    }
+}
+
+/* ---- Main ---- */
+
+int main(int argc, char **argv) {
+    Batch b;
+    int threads = (int)std::thread::hardware_concurrency();
+    const char *list_path = NULL;
+    const char *out_path = NULL;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            b.window_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            b.jsonl = strcmp(argv[++i], "jsonl") == 0;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            list_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-j threads] [-w window_s] [-f csv|jsonl] "
+                    "[-o out] [-l list.txt] [file.wav ...]\n", argv[0]);
+            return 1;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (list_path) {
+        std::ifstream list(list_path);
+        if (!list.is_open()) { fprintf(stderr, "Cannot open %s\n", list_path); return 1; }
+        std::string line;
+        while (std::getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) paths.push_back(line);
+        }
+    }
+    if (paths.empty()) { fprintf(stderr, "No input files\n"); return 1; }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (b.window_seconds < 1.0f) b.window_seconds = 1.0f;
+
+    if (out_path) {
+        b.out = fopen(out_path, "w");
+        if (!b.out) { fprintf(stderr, "Cannot write %s\n", out_path); return 1; }
+    }
+    if (!b.jsonl) fprintf(b.out, "path,key,key_index,confidence,windows,seconds,error\n");
+
+    std::vector<FileJob> jobs(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) jobs[i].path = paths[i];
+    b.jobs = &jobs;
+
+    /* Destroying the last context stops the wrapper's analysis threads;
+     * hold one idle context so they aren't restarted for every file.  It
+     * never hears audio, so it never allocates analysis buffers. */
+    void *keep_pool = kd_create(44100);
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++) pool.emplace_back(worker_fn, &b);
+    for (auto &t : pool) t.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    double audio_seconds = 0.0;
+    for (auto &j : jobs) audio_seconds += j.seconds;
+    fprintf(stderr, "%d files (%d failed), %.0f s of audio in %.1f s on %d threads (%.0fx realtime)\n",
+            b.done.load(), b.failed.load(), audio_seconds, elapsed, threads,
+            elapsed > 0 ? audio_seconds / elapsed : 0.0);
+
+    kd_destroy(keep_pool);
+    if (b.out != stdout) fclose(b.out);
+    return b.failed.load() > 0 ? 2 : 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * bench_feed.cpp - Microbenchmark for the kd_feed front end
+ *
+ * Times the downmix + resample path that kd_feed runs per audio block
+ * against what it replaced.  "baseline" is the original kd_feed loop,
+ * copied below: two int16 -> double divides, a downsample_counter branch
+ * and a % per sample, picking every Nth sample with no filter.  "scalar"
+ * is the same anti-aliasing decimator kd_feed now runs but written as
+ * plain scalar loops, and checks the kernels in kd_resampler.h sample for
+ * sample; "simd" is those kernels, and at 128 frames "fixed" is the
+ * compile-time specialised decimator as well.
+ * Needs no libkeyfinder:
+ *
+ *   g++ -O2 -std=c++17 -o bench_feed test/bench_feed.cpp
+ *   ./bench_feed [block_frames] [iterations]
+ */
+
+#include "../src/dsp/kd_resampler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+
+/* ---- Baseline: the original kd_feed loop ---- */
+
+#define BASE_WINDOW_SAMPLES (4 * 11025)
+
+struct base_feed {
+    double bufs[2][BASE_WINDOW_SAMPLES];
+    int active_buf;
+    int write_pos;
+    int downsample_counter;
+};
+
+/* DOWNSAMPLE was a fixed 4 then; it's a template argument here so the %
+ * stays a constant at the other rates too, as it was */
+template <int DOWNSAMPLE>
+static int base_feed_block(base_feed *ctx, const int16_t *stereo_audio, int frames) {
+    int buf_idx = ctx->active_buf;
+    double *buf = ctx->bufs[buf_idx];
+    int pos = ctx->write_pos;
+
+    for (int i = 0; i < frames; i++) {
+        /* Simple decimation: take every Nth sample */
+        if (ctx->downsample_counter == 0) {
+            double left  = stereo_audio[i * 2]     / 32768.0;
+            double right = stereo_audio[i * 2 + 1] / 32768.0;
+            buf[pos] = (left + right) * 0.5;
+            pos++;
+
+            /* Check if we've filled a window: swap buffers */
+            if (pos >= BASE_WINDOW_SAMPLES) {
+                buf_idx = 1 - buf_idx;
+                ctx->active_buf = buf_idx;
+                buf = ctx->bufs[buf_idx];
+                pos = 0;
+            }
+        }
+        ctx->downsample_counter = (ctx->downsample_counter + 1) % DOWNSAMPLE;
+    }
+
+    ctx->write_pos = pos;
+    return pos;
+}
+
+static int base_feed_any(base_feed *ctx, int factor, const int16_t *stereo, int frames) {
+    switch (factor) {
+    case 2:  return base_feed_block<2>(ctx, stereo, frames);
+    case 8:  return base_feed_block<8>(ctx, stereo, frames);
+    default: return base_feed_block<4>(ctx, stereo, frames);
+    }
+}
+
+/* ---- Reference: scalar downmix + ring-history decimator ---- */
+
+struct ref_decimator {
+    int factor;
+    int taps;
+    int phase;
+    int hist_pos;
+    float coefs[KD_DECIM_MAX_TAPS];
+    float hist[2 * KD_DECIM_MAX_TAPS];
+};
+
+static void ref_init(ref_decimator *d, int factor) {
+    d->factor = factor;
+    d->taps = (factor * KD_DECIM_TAPS_PER_PHASE + 7) & ~7;
+    d->phase = 0;
+    d->hist_pos = 0;
+    memset(d->hist, 0, sizeof(d->hist));
+    kd_design_lowpass(d->coefs, d->taps, 0.45 / factor);
+}
+
+static float ref_dot(const float *a, const float *b, int n) {
+    float acc = 0.0f;
+    for (int i = 0; i < n; i++) acc += a[i] * b[i];
+    return acc;
+}
+
+static int ref_process(ref_decimator *d, const float *in, int n, float *out) {
+    const int taps = d->taps;
+    int pos = d->hist_pos;
+    int phase = d->phase;
+    int produced = 0;
+    for (int i = 0; i < n; i++) {
+        d->hist[pos] = in[i];
+        d->hist[pos + taps] = in[i];
+        if (++pos == taps) pos = 0;
+        if (phase == 0) {
+            out[produced++] = ref_dot(d->hist + pos, d->coefs, taps);
+            phase = d->factor;
+        }
+        phase--;
+    }
+    d->hist_pos = pos;
+    d->phase = phase;
+    return produced;
+}
+
+static void ref_downmix(const int16_t *stereo, int frames, float *mono) {
+    for (int i = 0; i < frames; i++) {
+        mono[i] = (float)(stereo[i * 2] + stereo[i * 2 + 1]) * (0.5f / 32768.0f);
+    }
+}
+
+/* ---- Timing ---- */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile float g_sink;
+
+int main(int argc, char **argv) {
+    int block = argc > 1 ? atoi(argv[1]) : 128;
+    int iters = argc > 2 ? atoi(argv[2]) : 200000;
+    if (block < 1 || block > 4096 || iters < 1) {
+        fprintf(stderr, "Usage: %s [block_frames 1..4096] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    int16_t *stereo = (int16_t*)malloc(block * 2 * sizeof(int16_t));
+    float *mono = (float*)malloc(block * sizeof(float));
+    float *out = (float*)malloc((block + 1) * sizeof(float));
+    float *out_ref = (float*)malloc((block + 1) * sizeof(float));
+    for (int i = 0; i < block * 2; i++) {
+        stereo[i] = (int16_t)(8000.0 * sin(i * 0.01) + (rand() % 2001 - 1000));
+    }
+
+    printf("block=%d frames, %d iterations\n", block, iters);
+
+    /* Downmix alone */
+    double t0 = now_ns();
+    for (int it = 0; it < iters; it++) {
+        ref_downmix(stereo, block, mono);
+        g_sink = mono[it % block];
+    }
+    double t1 = now_ns();
+    for (int it = 0; it < iters; it++) {
+        kd_downmix_s16(stereo, block, mono);
+        g_sink = mono[it % block];
+    }
+    double t2 = now_ns();
+    printf("  downmix            scalar %8.1f ns/block   simd %8.1f ns/block\n",
+           (t1 - t0) / iters, (t2 - t1) / iters);
+
+    /* Downmix + decimate, integer factors the host rates map to */
+    static const int rates[] = { 22050, 44100, 88200 };
+    for (int r = 0; r < 3; r++) {
+        int factor = rates[r] / 11025;
+        ref_decimator ref;
+        kd_decimator dec;
+        ref_init(&ref, factor);
+        kd_decimator_init(&dec, factor);
+
+        /* The two decimators must agree sample for sample */
+        float max_err = 0.0f;
+        for (int it = 0; it < 64; it++) {
+            ref_downmix(stereo, block, mono);
+            int a = ref_process(&ref, mono, block, out_ref);
+            int b = kd_decimator_process(&dec, mono, block, out);
+            if (a != b) {
+                fprintf(stderr, "  output count mismatch at %d Hz: %d vs %d\n", rates[r], a, b);
+                return 1;
+            }
+            for (int i = 0; i < a; i++) {
+                float e = fabsf(out[i] - out_ref[i]);
+                if (e > max_err) max_err = e;
+            }
+        }
+
+        static base_feed base;
+        memset(&base, 0, sizeof(base));
+        double tb = now_ns();
+        for (int it = 0; it < iters; it++) {
+            int p = base_feed_any(&base, factor, stereo, block);
+            g_sink = (float)base.bufs[base.active_buf][p];
+        }
+
+        t0 = now_ns();
+        for (int it = 0; it < iters; it++) {
+            ref_downmix(stereo, block, mono);
+            int n = ref_process(&ref, mono, block, out_ref);
+            if (n) g_sink = out_ref[n - 1];
+        }
+        t1 = now_ns();
+        for (int it = 0; it < iters; it++) {
+            kd_downmix_s16(stereo, block, mono);
+            int n = kd_decimator_process(&dec, mono, block, out);
+            if (n) g_sink = out[n - 1];
+        }
+        t2 = now_ns();
+        printf("  feed %6d Hz /%d  baseline %8.1f   scalar %8.1f   simd %8.1f ns/block   (max diff %.2g)\n",
+               rates[r], factor, (t0 - tb) / iters, (t1 - t0) / iters, (t2 - t1) / iters, max_err);
+    }
+
+    /* The compile-time path kd_feed takes for Move's 128 frames at 44.1 kHz */
+    if (block == 128) {
+        kd_decimator dec, fixed;
+        kd_decimator_init(&dec, 4);
+        kd_decimator_init(&fixed, 4);
+
+        float max_err = 0.0f;
+        for (int it = 0; it < 64; it++) {
+            kd_downmix_s16(stereo, block, mono);
+            int a = kd_decimator_process(&dec, mono, block, out_ref);
+            kd_decimator_process_fixed<4, 128>(&fixed, mono, out);
+            for (int i = 0; i < a; i++) {
+                float e = fabsf(out[i] - out_ref[i]);
+                if (e > max_err) max_err = e;
+            }
+        }
+
+        t0 = now_ns();
+        for (int it = 0; it < iters; it++) {
+            kd_downmix_s16(stereo, 128, mono);
+            kd_decimator_process_fixed<4, 128>(&fixed, mono, out);
+            g_sink = out[31];
+        }
+        t1 = now_ns();
+        printf("  feed  44100 Hz /4  fixed  %8.1f ns/block   (max diff vs simd %.2g)\n",
+               (t1 - t0) / iters, max_err);
+    }
+
+    free(stereo);
+    free(mono);
+    free(out);
+    free(out_ref);
+    return 0;
+}
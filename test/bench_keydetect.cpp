@@ -0,0 +1,332 @@
+/*
+ * bench_keydetect.cpp - Performance benchmarks for the wrapper and plugin paths
+ *
+ * Cases:
+ *   feed     kd_feed ns per 128-frame block on a paced "audio thread",
+ *            with 1/4/8/16 concurrent instances (process CPU and window
+ *            counters alongside, to show the pool keeping up)
+ *   window   libkeyfinder keyOfAudio latency per window size, 1 - 8 s
+ *   e2e      time from the first block of new audio to kd_get_key
+ *            reporting the new key, with the plugin's default window/hop
+ *   lifecycle kd_create and kd_destroy wall time (a patch load or preset
+ *            change), alone and next to 8 other instances; each instance
+ *            is fed a second of audio in between, so its buffers are live
+ *
+ * Each result is one JSON line tagged with the version in release.json,
+ * so runs can be compared across releases:
+ *
+ *   bench_keydetect [-r release.json] [-t seconds_per_scaling_run]
+ *                   [-p nice|batch|idle] [-s slice_us]
+ *                   [-e keyfinder|krumhansl|temperley] > bench.jsonl
+ *
+ * -p/-s set the analysis threads' scheduling (kd_set_scheduling); feed
+ * results report the longest analysis run between yields as max_run_ms.
+ * -e picks the analysis engine for the feed and e2e cases.
+ */
+
+#include "../src/dsp/keyfinder_wrapper.h"
+
+#include <keyfinder/keyfinder.h>
+#include <keyfinder/audiodata.h>
+#include <keyfinder/constants.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <sys/resource.h>
+
+#define RATE 44100
+#define BLOCK 128
+
+static std::string g_version = "unknown";
+static int g_engine = KD_ENGINE_KEYFINDER;
+static const char *g_engine_names[] = { "keyfinder", "krumhansl", "temperley" };
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_s(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+/* Hold the caller to real time: return once `audio_s` has elapsed */
+static void pace(double start, double audio_s) {
+    double ahead = audio_s - (now_s() - start);
+    if (ahead > 0.0005) {
+        struct timespec ts = { 0, (long)((ahead - 0.0002) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+    while (now_s() - start < audio_s) {}
+}
+
+static void read_version(const char *path) {
+    std::ifstream f(path);
+    if (!f.is_open()) return;
+    std::stringstream ss;
+    ss << f.rdbuf();
+    std::string s = ss.str();
+    size_t k = s.find("\"version\"");
+    if (k == std::string::npos) return;
+    size_t q1 = s.find('"', s.find(':', k) + 1);
+    size_t q2 = s.find('"', q1 + 1);
+    if (q1 != std::string::npos && q2 != std::string::npos) g_version = s.substr(q1 + 1, q2 - q1 - 1);
+}
+
+/* ---- Test signal: a sustained triad with harmonics over a bass root ---- */
+
+static void make_chord(std::vector<int16_t> &stereo, int frames, double root_hz, bool minor) {
+    const double ratios[] = { 1.0, minor ? 1.189207 : 1.259921, 1.498307 };
+    stereo.resize((size_t)frames * 2);
+    for (int i = 0; i < frames; i++) {
+        double t = (double)i / RATE;
+        double v = 0.25 * sin(2 * M_PI * root_hz * 0.5 * t);
+        for (double r : ratios) {
+            for (int h = 1; h <= 3; h++) v += 0.15 / h * sin(2 * M_PI * root_hz * r * h * t);
+        }
+        int16_t s = (int16_t)(v * 0.5 * 32767);
+        stereo[i * 2] = stereo[i * 2 + 1] = s;
+    }
+}
+
+static double percentile(std::vector<double> &v, double p) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)(p * (v.size() - 1));
+    return v[i];
+}
+
+/* ---- feed: kd_feed cost and pool scaling ---- */
+
+static void bench_feed(int instances, double seconds, const std::vector<int16_t> &audio) {
+    std::vector<void*> kd(instances);
+    for (auto &k : kd) {
+        k = kd_create(RATE);
+        kd_set_engine(k, g_engine);
+        kd_set_window(k, 4.0f);
+        kd_set_hop(k, 1.0f);
+    }
+
+    int blocks = (int)(seconds * RATE / BLOCK);
+    int audio_blocks = (int)(audio.size() / 2 / BLOCK);
+    std::vector<double> ns;
+    ns.reserve((size_t)blocks * instances);
+
+    kd_get_max_run_ms();
+    double start = now_s(), cpu0 = cpu_s();
+    for (int b = 0; b < blocks; b++) {
+        const int16_t *blk = audio.data() + (size_t)(b % audio_blocks) * BLOCK * 2;
+        for (auto k : kd) {
+            double t0 = now_s();
+            kd_feed(k, blk, BLOCK);
+            ns.push_back((now_s() - t0) * 1e9);
+        }
+        pace(start, (double)(b + 1) * BLOCK / RATE);
+    }
+    double wall = now_s() - start, cpu = cpu_s() - cpu0;
+    float max_run = kd_get_max_run_ms();
+
+    uint32_t analyzed = 0, coalesced = 0, dropped = 0;
+    for (auto k : kd) {
+        uint32_t a, c, d;
+        kd_get_window_counts(k, &a, &c, &d);
+        analyzed += a; coalesced += c; dropped += d;
+        kd_destroy(k);
+    }
+
+    double mean = 0;
+    for (double v : ns) mean += v;
+    mean /= ns.size();
+    double p99 = percentile(ns, 0.99), max = ns.back();
+
+    printf("{\"bench\":\"feed\",\"version\":\"%s\",\"engine\":\"%s\",\"instances\":%d,\"seconds\":%.1f,"
+           "\"block\":%d,\"feed_ns_mean\":%.0f,\"feed_ns_p99\":%.0f,\"feed_ns_max\":%.0f,"
+           "\"cpu_percent\":%.1f,\"max_run_ms\":%.2f,\"analyzed\":%u,\"coalesced\":%u,"
+           "\"dropped\":%u}\n",
+           g_version.c_str(), g_engine_names[g_engine], instances, seconds, BLOCK, mean, p99, max,
+           100.0 * cpu / wall, max_run, analyzed, coalesced, dropped);
+    fflush(stdout);
+}
+
+/* ---- window: keyOfAudio latency per window size ---- */
+
+static void bench_window(const std::vector<int16_t> &audio) {
+    const int rate = 11025, reps = 5;
+    KeyFinder::KeyFinder kf;
+
+    for (int seconds = 1; seconds <= 8; seconds++) {
+        int n = seconds * rate;
+        KeyFinder::AudioData a;
+        a.setChannels(1);
+        a.setFrameRate(rate);
+        a.addToSampleCount(n);
+        for (int i = 0; i < n; i++) {
+            size_t src = ((size_t)i * 4 * 2) % audio.size();
+            a.setSample(i, audio[src] / 32768.0);
+        }
+
+        kf.keyOfAudio(a);   /* first call builds this rate's kernels */
+        std::vector<double> ms;
+        for (int r = 0; r < reps; r++) {
+            double t0 = now_s();
+            kf.keyOfAudio(a);
+            ms.push_back((now_s() - t0) * 1e3);
+        }
+        double median = percentile(ms, 0.5), max = ms.back();
+        printf("{\"bench\":\"window\",\"version\":\"%s\",\"window_s\":%d,"
+               "\"key_of_audio_ms_median\":%.2f,\"key_of_audio_ms_max\":%.2f}\n",
+               g_version.c_str(), seconds, median, max);
+        fflush(stdout);
+    }
+}
+
+/* ---- e2e: new audio arriving -> kd_get_key changing ---- */
+
+static void bench_e2e(const std::vector<int16_t> &from, const std::vector<int16_t> &to) {
+    const double timeout = 20.0;
+    const int runs = 3;
+
+    /* What the detector should settle on for the new audio */
+    void *ref = kd_create(RATE);
+    kd_set_engine(ref, g_engine);
+    kd_set_window(ref, 4.0f);
+    kd_result want;
+    if (!kd_analyze_buffer(ref, to.data(), (int)(to.size() / 2), &want)) {
+        fprintf(stderr, "e2e: no key for the target signal\n");
+        kd_destroy(ref);
+        return;
+    }
+    kd_destroy(ref);
+
+    for (int run = 0; run < runs; run++) {
+        void *kd = kd_create(RATE);
+        kd_set_engine(kd, g_engine);
+        kd_set_window(kd, 4.0f);
+        kd_set_hop(kd, 1.0f);
+
+        /* Settle on the old key offline, then switch live */
+        kd_result r;
+        if (!kd_analyze_buffer(kd, from.data(), (int)(from.size() / 2), &r) || r.key == want.key) {
+            fprintf(stderr, "e2e: both signals give %s, nothing to measure\n", kd_key_name(want.key));
+            kd_destroy(kd);
+            return;
+        }
+        int from_key = r.key;
+
+        int to_blocks = (int)(to.size() / 2 / BLOCK);
+        double start = now_s(), latency = -1.0;
+        for (int b = 0; now_s() - start < timeout; b++) {
+            kd_feed(kd, to.data() + (size_t)(b % to_blocks) * BLOCK * 2, BLOCK);
+            if (kd_get_result(kd, &r) && r.key == want.key) {
+                latency = now_s() - start;
+                break;
+            }
+            pace(start, (double)(b + 1) * BLOCK / RATE);
+        }
+
+        printf("{\"bench\":\"e2e\",\"version\":\"%s\",\"engine\":\"%s\",\"run\":%d,"
+               "\"window_s\":4,\"hop_s\":1,"
+               "\"from\":\"%s\",\"to\":\"%s\",\"latency_ms\":%.0f}\n",
+               g_version.c_str(), g_engine_names[g_engine], run, kd_key_name(from_key),
+               kd_key_name(want.key),
+               latency < 0 ? -1.0 : latency * 1e3);
+        fflush(stdout);
+        kd_destroy(kd);
+    }
+}
+
+/* ---- lifecycle: instance create/destroy cost ---- */
+
+static void bench_lifecycle(int others, const std::vector<int16_t> &audio) {
+    const int reps = 50;
+    const int blocks = RATE / BLOCK;
+
+    std::vector<void*> bg(others);
+    for (auto &k : bg) k = kd_create(RATE);
+
+    std::vector<double> create_us, destroy_us;
+    for (int r = 0; r < reps; r++) {
+        double t0 = now_s();
+        void *kd = kd_create(RATE);
+        kd_set_engine(kd, g_engine);
+        kd_set_window(kd, 4.0f);
+        kd_set_hop(kd, 1.0f);
+        create_us.push_back((now_s() - t0) * 1e6);
+
+        for (int b = 0; b < blocks; b++) {
+            kd_feed(kd, audio.data() + (size_t)b * BLOCK * 2, BLOCK);
+        }
+
+        t0 = now_s();
+        kd_destroy(kd);
+        destroy_us.push_back((now_s() - t0) * 1e6);
+    }
+    for (auto k : bg) kd_destroy(k);
+
+    double create_med = percentile(create_us, 0.5), create_max = create_us.back();
+    double destroy_med = percentile(destroy_us, 0.5), destroy_max = destroy_us.back();
+    printf("{\"bench\":\"lifecycle\",\"version\":\"%s\",\"engine\":\"%s\",\"others\":%d,"
+           "\"create_us_median\":%.1f,\"create_us_max\":%.1f,"
+           "\"destroy_us_median\":%.1f,\"destroy_us_max\":%.1f}\n",
+           g_version.c_str(), g_engine_names[g_engine], others,
+           create_med, create_max, destroy_med, destroy_max);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *release = "release.json";
+    double seconds = 10.0;
+    int policy = KD_SCHED_NICE, slice_us = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            release = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            i++;
+            policy = strcmp(argv[i], "idle") == 0 ? KD_SCHED_IDLE :
+                     strcmp(argv[i], "batch") == 0 ? KD_SCHED_BATCH : KD_SCHED_NICE;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            slice_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            i++;
+            g_engine = strcmp(argv[i], "krumhansl") == 0 ? KD_ENGINE_KRUMHANSL :
+                       strcmp(argv[i], "temperley") == 0 ? KD_ENGINE_TEMPERLEY : KD_ENGINE_KEYFINDER;
+        } else {
+            fprintf(stderr, "Usage: %s [-r release.json] [-t seconds] [-p nice|batch|idle] "
+                    "[-s slice_us] [-e keyfinder|krumhansl|temperley]\n", argv[0]);
+            return 1;
+        }
+    }
+    read_version(release);
+    if (kd_set_scheduling(policy, 0, slice_us) != 0) {
+        fprintf(stderr, "Scheduling policy not supported here\n");
+        return 1;
+    }
+
+    std::vector<int16_t> c_major, fs_major;
+    make_chord(c_major, RATE * 12, 261.63, false);
+    make_chord(fs_major, RATE * 12, 369.99, false);
+
+    static const int counts[] = { 1, 4, 8, 16 };
+    for (int n : counts) bench_feed(n, seconds, c_major);
+    bench_window(c_major);
+    bench_e2e(c_major, fs_major);
+    bench_lifecycle(0, c_major);
+    bench_lifecycle(8, c_major);
+    return 0;
+}
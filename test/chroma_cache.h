@@ -0,0 +1,198 @@
+/*
+ * chroma_cache.h - On-disk cache of per-frame chroma for the test tools
+ *
+ * Decoding a track and running it through libkeyfinder's FFT stages is
+ * most of an offline run, while the key voting and profile experiments on
+ * top only need the chroma.  This caches the chroma, one file per track
+ * and front end, so re-runs skip straight to the key estimation, however
+ * the frames are then split into windows or voted.
+ *
+ * Files are named by a hash of the audio file's bytes plus a tag naming
+ * the front end that produced the chroma (rate and downsampler), so an
+ * edited or re-encoded track, or a changed pipeline, simply misses, while
+ * a touched, moved or copied one still hits.  Hashing a whole track costs
+ * about as much as mapping it in, so the hash is remembered in a small
+ * index entry per file identity (chroma_hash) and an unchanged file is
+ * read in full only once.  The
+ * format is a 64-byte header followed by hops * bands float32 magnitudes,
+ * hop-major, in native byte order, so a hit is an mmap with no parsing.
+ * Writes go to a temporary file renamed into place, so parallel runs
+ * never see a partial file.
+ *
+ * Header-only and independent of libkeyfinder, like wav_reader.h.
+ */
+
+#ifndef CHROMA_CACHE_H
+#define CHROMA_CACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CHROMA_CACHE_MAGIC   "KDCHROMA"
+#define CHROMA_CACHE_VERSION 1
+#define CHROMA_CACHE_TAG_LEN 32
+
+struct chroma_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t bands;
+    uint32_t hops;
+    uint32_t rate;                      /* sample rate the chroma was taken at */
+    uint64_t source_hash;               /* chroma_hash of the audio file */
+    char tag[CHROMA_CACHE_TAG_LEN];     /* front end, e.g. "11025-pick4" */
+};
+
+static_assert(sizeof(chroma_cache_header) == 64, "header layout");
+
+/* A mapped cache file */
+struct chroma_file {
+    const uint8_t *map;
+    size_t map_len;
+    const float *frames;   /* hops * bands, hop-major */
+    int hops;
+    int bands;
+    int rate;
+};
+
+#define CHROMA_FNV_OFFSET 1469598103934665603ULL
+
+/* FNV-1a 64 over n bytes, continuing from h */
+static inline uint64_t chroma_fnv(uint64_t h, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Content hash of the audio file at path, whose bytes are mapped at
+ * map/len: FNV-1a over all of them.  When dir is set the hash is kept in
+ * dir/<identity>.id, the identity being the file's device, inode, size,
+ * mtime and ctime, and read back from there while they stay the same.
+ * Nothing resets ctime (not cp -p, rsync -t or touch), so an edit always
+ * forces a rehash; a touched or copied file rehashes to the same value
+ * and still hits. */
+static inline uint64_t chroma_hash(const char *dir, const char *path,
+                                   const uint8_t *map, size_t len) {
+    struct stat st;
+    char id_path[1024] = "";
+    if (dir && stat(path, &st) == 0) {
+        int64_t id[7] = { (int64_t)st.st_dev, (int64_t)st.st_ino, (int64_t)st.st_size,
+                          (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec,
+                          (int64_t)st.st_ctim.tv_sec, (int64_t)st.st_ctim.tv_nsec };
+        snprintf(id_path, sizeof(id_path), "%s/%016llx.id", dir,
+                 (unsigned long long)chroma_fnv(CHROMA_FNV_OFFSET, id, sizeof(id)));
+
+        uint64_t known;
+        int fd = open(id_path, O_RDONLY);
+        if (fd >= 0) {
+            bool ok = read(fd, &known, sizeof(known)) == (ssize_t)sizeof(known);
+            close(fd);
+            if (ok) return known;
+        }
+    }
+
+    uint64_t h = chroma_fnv(CHROMA_FNV_OFFSET, map, len);
+
+    if (id_path[0]) {
+        mkdir(dir, 0755);
+        char tmp[1100];
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", id_path, (int)getpid());
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            bool ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h);
+            ok = (close(fd) == 0) && ok;
+            if (!ok || rename(tmp, id_path) != 0) unlink(tmp);
+        }
+    }
+    return h;
+}
+
+static inline void chroma_cache_path(char *buf, size_t len, const char *dir,
+                                     uint64_t hash, const char *tag) {
+    snprintf(buf, len, "%s/%016llx-%s.chroma", dir, (unsigned long long)hash, tag);
+}
+
+/* Map the cached chroma for (hash, tag).  Returns false on a miss or a
+ * file that doesn't match what its name promises. */
+static inline bool chroma_cache_open(chroma_file *f, const char *dir, uint64_t hash,
+                                     const char *tag) {
+    memset(f, 0, sizeof(*f));
+    char path[1024];
+    chroma_cache_path(path, sizeof(path), dir, hash, tag);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(chroma_cache_header)) {
+        close(fd);
+        return false;
+    }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return false;
+
+    const chroma_cache_header *h = (const chroma_cache_header*)m;
+    size_t want = sizeof(*h) + (size_t)h->hops * h->bands * sizeof(float);
+    if (memcmp(h->magic, CHROMA_CACHE_MAGIC, 8) != 0 || h->version != CHROMA_CACHE_VERSION ||
+        h->source_hash != hash || strncmp(h->tag, tag, CHROMA_CACHE_TAG_LEN) != 0 ||
+        h->bands == 0 || (size_t)st.st_size != want) {
+        munmap(m, st.st_size);
+        return false;
+    }
+
+    f->map = (const uint8_t*)m;
+    f->map_len = st.st_size;
+    f->frames = (const float*)(f->map + sizeof(*h));
+    f->hops = (int)h->hops;
+    f->bands = (int)h->bands;
+    f->rate = (int)h->rate;
+    return true;
+}
+
+static inline void chroma_cache_close(chroma_file *f) {
+    if (f->map) munmap((void*)f->map, f->map_len);
+    memset(f, 0, sizeof(*f));
+}
+
+/* Store chroma for (hash, tag), creating dir (one level) if needed.
+ * Returns false if it couldn't be written; the cache is only ever an
+ * optimisation, so callers carry on either way. */
+static inline bool chroma_cache_store(const char *dir, uint64_t hash, const char *tag,
+                                      int rate, const float *frames, int hops, int bands) {
+    mkdir(dir, 0755);
+
+    chroma_cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHROMA_CACHE_MAGIC, 8);
+    h.version = CHROMA_CACHE_VERSION;
+    h.bands = bands;
+    h.hops = hops;
+    h.rate = rate;
+    h.source_hash = hash;
+    strncpy(h.tag, tag, CHROMA_CACHE_TAG_LEN - 1);
+
+    char path[1024], tmp[1100];
+    chroma_cache_path(path, sizeof(path), dir, hash, tag);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return false;
+    size_t n = (size_t)hops * bands;
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+              (n == 0 || fwrite(frames, sizeof(float), n, fp) == n);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+#endif /* CHROMA_CACHE_H */
@@ -0,0 +1,428 @@
+/*
+ * sweep.cpp - Parallel grid search over the detector's tuning parameters
+ *
+ * Evaluates every combination of analysis window, hop, VOTE_DECAY,
+ * DOWNSAMPLE factor and decimator over test_files.txt, and reports
+ * accuracy against the CPU a live instance with that configuration would
+ * spend, so the cheapest configuration meeting an accuracy bar can be
+ * picked:
+ *
+ *   sweep [-w 2,4,8] [-o 0.5:2:0.5] [-d 0.4,0.6,0.8] [-s 2,4] [-m fir,pick]
+ *         [-a exact_percent] [-j threads] [-l test_files.txt] [-A audio_dir]
+ *
+ * Lists are comma-separated values or lo:hi:step ranges.  Hops longer
+ * than their window are skipped, as kd_set_hop would clamp them.
+ *
+ * Work is shared as far down as it goes: each track is decoded once;
+ * each (track, DOWNSAMPLE, decimator) is downsampled and turned into
+ * chroma once, recording how many frames existed after every chroma hop;
+ * each window/hop/decay combination then only replays the wrapper's
+ * estimate-and-vote schedule over those frames.  Both stages run across
+ * all cores.
+ *
+ * The replay mirrors analyze_pending: every hop of audio the key is
+ * estimated over the last window of chroma and voted in with decay
+ * VOTE_DECAY ^ (hop / window); the final key is the vote winner at the
+ * end of the track.  Windows are counted in frames at the rate libkeyfinder
+ * ran its FFTs at, which it lowers itself above about 11025 Hz, so a 4 s
+ * window is 4 s of audio at every DOWNSAMPLE factor.  CPU is thread CPU time for the downsampling, chroma
+ * and estimates, as a percentage of one core per second of audio.
+ */
+
+#include "../src/dsp/kd_resampler.h"
+#include "wav_reader.h"
+
+#include <keyfinder/keyfinder.h>
+#include <keyfinder/audiodata.h>
+#include <keyfinder/constants.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+static const char* key_names[] = {
+    "A maj",  "A min",  "Bb maj", "Bb min",
+    "B maj",  "B min",  "C maj",  "C min",
+    "Db maj", "Db min", "D maj",  "D min",
+    "Eb maj", "Eb min", "E maj",  "E min",
+    "F maj",  "F min",  "Gb maj", "Gb min",
+    "G maj",  "G min",  "Ab maj", "Ab min",
+    "---"
+};
+
+#define NUM_KEYS 24
+
+/* ---- Key comparison helpers (as test_direct) ---- */
+
+static std::string normalize_key(const std::string &key) {
+    std::string k = key;
+    size_t pos;
+    if ((pos = k.find("major")) != std::string::npos) k.replace(pos, 5, "maj");
+    if ((pos = k.find("minor")) != std::string::npos) k.replace(pos, 5, "min");
+    while ((pos = k.find("  ")) != std::string::npos) k.replace(pos, 2, " ");
+    while (!k.empty() && k.back() == ' ') k.pop_back();
+    while (!k.empty() && k.front() == ' ') k.erase(k.begin());
+    return k;
+}
+
+static bool keys_are_relative(const std::string &a, const std::string &b) {
+    static const char* rels[][2] = {
+        {"C maj", "A min"}, {"Db maj", "Bb min"}, {"D maj", "B min"},
+        {"Eb maj", "C min"}, {"E maj", "Db min"}, {"F maj", "D min"},
+        {"Gb maj", "Eb min"}, {"G maj", "E min"}, {"Ab maj", "F min"},
+        {"A maj", "Gb min"}, {"Bb maj", "G min"}, {"B maj", "Ab min"},
+    };
+    for (auto &p : rels)
+        if ((a == p[0] && b == p[1]) || (a == p[1] && b == p[0])) return true;
+    return false;
+}
+
+static double thread_cpu_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ---- Parameter lists ---- */
+
+/* "a,b,c" and/or "lo:hi:step" items */
+static std::vector<double> parse_list(const char *s) {
+    std::vector<double> out;
+    std::string str(s);
+    size_t start = 0;
+    while (start <= str.size()) {
+        size_t end = str.find(',', start);
+        if (end == std::string::npos) end = str.size();
+        std::string item = str.substr(start, end - start);
+        double lo, hi, step;
+        if (sscanf(item.c_str(), "%lf:%lf:%lf", &lo, &hi, &step) == 3 && step > 0) {
+            for (double v = lo; v <= hi + step * 1e-6; v += step) out.push_back(v);
+        } else if (!item.empty()) {
+            out.push_back(atof(item.c_str()));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+#define DECIM_PICK 0   /* every DOWNSAMPLE-th sample, as test_direct */
+#define DECIM_FIR  1   /* kd_decimator, as the wrapper */
+
+static const char* decim_names[] = { "pick", "fir" };
+
+/* ---- Shared work ---- */
+
+struct Track {
+    std::string base, expected;
+    std::vector<float> mono;   /* decoded at the file rate */
+    int rate = 0;
+};
+
+struct Variant {
+    int downsample;
+    int decim;
+};
+
+/* One track's chroma for one variant */
+struct Chroma {
+    int rate = 0;
+    std::vector<float> frames;   /* hops * BANDS, hop-major */
+    std::vector<int> avail;      /* frames that existed after each HOPSIZE of audio */
+    int internal = 1;            /* libkeyfinder's own downsampling at this rate */
+    double cpu_s = 0;            /* downsampling + chroma */
+    double audio_s = 0;
+};
+
+struct Config {
+    float window, hop, decay;
+    int variant;
+    /* results */
+    int exact = 0, correct = 0, total = 0;
+    double cpu_s = 0, audio_s = 0;
+
+    Config(float w, float h, float d, int v) : window(w), hop(h), decay(d), variant(v) {}
+};
+
+static void downsample(const Track &t, const Variant &v, std::vector<float> &out) {
+    int n = (int)t.mono.size();
+    if (v.downsample <= 1) {
+        out = t.mono;
+    } else if (v.decim == DECIM_PICK) {
+        out.resize((n + v.downsample - 1) / v.downsample);
+        for (size_t i = 0; i < out.size(); i++) out[i] = t.mono[i * v.downsample];
+    } else {
+        kd_decimator *d = new kd_decimator;
+        kd_decimator_init(d, v.downsample);
+        out.resize(n / v.downsample + 2);
+        int m = 0;
+        for (int i = 0; i < n; i += KD_DECIM_BLOCK) {
+            m += kd_decimator_process(d, t.mono.data() + i, std::min(KD_DECIM_BLOCK, n - i),
+                                      out.data() + m);
+        }
+        out.resize(m);
+        delete d;
+    }
+}
+
+static void build_chroma(KeyFinder::KeyFinder &kf, const Track &t, const Variant &v, Chroma &c) {
+    double t0 = thread_cpu_s();
+    std::vector<float> audio;
+    downsample(t, v, audio);
+    c.rate = t.rate / v.downsample;
+    c.audio_s = (double)t.mono.size() / t.rate;
+
+    /* A chroma hop at a time, like the wrapper's worker */
+    const int hop = (int)KeyFinder::HOPSIZE;
+    KeyFinder::Workspace ws;
+    for (size_t start = 0; start + hop <= audio.size(); start += hop) {
+        KeyFinder::AudioData a;
+        a.setChannels(1);
+        a.setFrameRate(c.rate);
+        a.addToSampleCount(hop);
+        for (int i = 0; i < hop; i++) a.setSample(i, audio[start + i]);
+        kf.progressiveChromagram(a, ws);
+        c.avail.push_back(ws.chromagram ? (int)ws.chromagram->getHops() : 0);
+    }
+
+    int hops = ws.chromagram ? (int)ws.chromagram->getHops() : 0;
+
+    /* libkeyfinder downsamples again before its FFT unless the audio is
+     * already at about 11025 Hz, so a frame covers HOPSIZE samples of its
+     * own rate, not of ours.  Measure the factor from the input it took
+     * per frame between the first and the last. */
+    int first = 0, last = (int)c.avail.size() - 1;
+    while (first < last && c.avail[first] == 0) first++;
+    if (first < last && hops > c.avail[first]) {
+        double per_frame = (double)(last - first) * KeyFinder::HOPSIZE / (hops - c.avail[first]);
+        c.internal = std::max(1, (int)lround(per_frame / KeyFinder::HOPSIZE));
+    }
+
+    c.frames.resize((size_t)hops * KeyFinder::BANDS);
+    for (int h = 0; h < hops; h++) {
+        for (unsigned b = 0; b < KeyFinder::BANDS; b++) {
+            c.frames[(size_t)h * KeyFinder::BANDS + b] = (float)ws.chromagram->getMagnitude(h, b);
+        }
+    }
+    c.cpu_s = thread_cpu_s() - t0;
+}
+
+static KeyFinder::key_t key_of_frames(KeyFinder::KeyFinder &kf, const Chroma &c,
+                                      int first, int count) {
+    KeyFinder::Workspace ws;
+    ws.chromagram = new KeyFinder::Chromagram(count);
+    for (int h = 0; h < count; h++) {
+        for (unsigned b = 0; b < KeyFinder::BANDS; b++) {
+            ws.chromagram->setMagnitude(h, b, c.frames[(size_t)(first + h) * KeyFinder::BANDS + b]);
+        }
+    }
+    return kf.keyOfChromagram(ws);
+}
+
+/* The wrapper's frame count for a window (chroma_frames_for), samples
+ * being at the rate libkeyfinder took the FFTs at */
+static int window_frames(int samples) {
+    if (samples <= (int)KeyFinder::FFTFRAMESIZE) return 1;
+    return (samples - (int)KeyFinder::FFTFRAMESIZE) / (int)KeyFinder::HOPSIZE + 1;
+}
+
+/* Replay the estimate-and-vote schedule; returns the final key index */
+static int replay(KeyFinder::KeyFinder &kf, const Config &cfg, const Chroma &c, double *cpu_s) {
+    double t0 = thread_cpu_s();
+    int window_samples = (int)(cfg.window * c.rate);
+    int hop_samples = std::max(1, (int)(cfg.hop * c.rate));
+    int wf = window_frames(window_samples / c.internal);
+    float decay = powf(cfg.decay, (float)hop_samples / window_samples);
+
+    float votes[NUM_KEYS] = {};
+    int best = NUM_KEYS;
+    int total = (int)c.avail.size() * (int)KeyFinder::HOPSIZE;
+    for (int t = hop_samples; t <= total; t += hop_samples) {
+        int blocks = t / (int)KeyFinder::HOPSIZE;
+        int frames = blocks > 0 ? c.avail[blocks - 1] : 0;
+        if (frames == 0) continue;
+        int count = std::min(frames, wf);
+        KeyFinder::key_t k = key_of_frames(kf, c, frames - count, count);
+        if (k < 0 || k >= NUM_KEYS) continue;
+
+        for (float &v : votes) v *= decay;
+        votes[k] += 1.0f;
+    }
+    float best_votes = 0.0f;
+    for (int k = 0; k < NUM_KEYS; k++) {
+        if (votes[k] > best_votes) { best_votes = votes[k]; best = k; }
+    }
+    *cpu_s = thread_cpu_s() - t0;
+    return best;
+}
+
+/* Run job(i) for i in [0, n) on `threads` threads, each with its own
+ * KeyFinder (its kernel caches aren't meant to be shared) */
+template <typename F>
+static void parallel_for(int n, int threads, F job) {
+    std::atomic<int> next(0);
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back([&]() {
+            KeyFinder::KeyFinder kf;
+            for (int i; (i = next.fetch_add(1)) < n;) job(kf, i);
+        });
+    }
+    for (auto &th : pool) th.join();
+}
+
+int main(int argc, char **argv) {
+    const char *test_list = "test/test_files.txt";
+    const char *audio_dir = "test/audio";
+    std::vector<double> windows = { 2, 4, 8 }, hops = { 1 }, decays = { 0.6 }, factors = { 4 };
+    std::vector<int> decims = { DECIM_FIR, DECIM_PICK };
+    double bar = -1.0;
+    int threads = (int)std::thread::hardware_concurrency();
+    if (threads < 1) threads = 1;
+
+    /* Every option takes a value */
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        const char *v = i + 1 < argc ? argv[++i] : NULL;
+        if (v && strcmp(opt, "-w") == 0) windows = parse_list(v);
+        else if (v && strcmp(opt, "-o") == 0) hops = parse_list(v);
+        else if (v && strcmp(opt, "-d") == 0) decays = parse_list(v);
+        else if (v && strcmp(opt, "-s") == 0) factors = parse_list(v);
+        else if (v && strcmp(opt, "-m") == 0) {
+            decims.clear();
+            if (strstr(v, "fir")) decims.push_back(DECIM_FIR);
+            if (strstr(v, "pick")) decims.push_back(DECIM_PICK);
+        }
+        else if (v && strcmp(opt, "-a") == 0) bar = atof(v);
+        else if (v && strcmp(opt, "-j") == 0) threads = std::max(1, atoi(v));
+        else if (v && strcmp(opt, "-l") == 0) test_list = v;
+        else if (v && strcmp(opt, "-A") == 0) audio_dir = v;
+        else {
+            fprintf(stderr, "Usage: %s [-w windows] [-o hops] [-d decays] [-s downsamples]\n"
+                    "         [-m fir,pick] [-a exact_percent] [-j threads]\n"
+                    "         [-l test_files.txt] [-A audio_dir]\n"
+                    "Lists are comma-separated values or lo:hi:step ranges.\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* Decode every track once */
+    std::ifstream list(test_list);
+    if (!list.is_open()) { fprintf(stderr, "Cannot open %s\n", test_list); return 1; }
+    std::vector<Track> tracks;
+    std::string line;
+    while (std::getline(list, line)) {
+        size_t sep = line.find('|');
+        if (sep == std::string::npos) continue;
+        Track t;
+        t.base = line.substr(0, sep);
+        t.expected = normalize_key(line.substr(sep + 1));
+        std::string path = std::string(audio_dir) + "/" + t.base + ".wav";
+        wav_reader wav;
+        if (!wav_open(&wav, path.c_str())) {
+            fprintf(stderr, "  SKIP %s\n", t.base.c_str());
+            continue;
+        }
+        t.rate = wav.sample_rate;
+        t.mono.resize(wav.frames);
+        int64_t got = 0;
+        int n;
+        while ((n = wav_read_mono(&wav, t.mono.data() + got, 65536)) > 0) got += n;
+        t.mono.resize(got);
+        wav_close(&wav);
+        tracks.push_back(std::move(t));
+    }
+    if (tracks.empty()) { fprintf(stderr, "No tracks\n"); return 1; }
+
+    /* Variants and configurations */
+    std::vector<Variant> variants;
+    for (double f : factors) {
+        int ds = (int)f;
+        if (ds < 1 || ds > KD_DECIM_MAX_FACTOR) continue;
+        if (ds == 1) { variants.push_back({ 1, DECIM_PICK }); continue; }
+        for (int m : decims) variants.push_back({ ds, m });
+    }
+    std::vector<Config> configs;
+    for (int v = 0; v < (int)variants.size(); v++) {
+        for (double w : windows) {
+            for (double h : hops) {
+                if (h <= 0 || h > w) continue;
+                for (double d : decays) configs.push_back({ (float)w, (float)h, (float)d, v });
+            }
+        }
+    }
+    if (configs.empty()) { fprintf(stderr, "No configurations\n"); return 1; }
+
+    printf("=== Parameter sweep ===\n");
+    printf("Tracks: %zu  variants: %zu  configurations: %zu  threads: %d\n\n",
+           tracks.size(), variants.size(), configs.size(), threads);
+
+    /* Chroma per (variant, track) */
+    int nt = (int)tracks.size();
+    std::vector<Chroma> chroma(variants.size() * nt);
+    parallel_for((int)chroma.size(), threads, [&](KeyFinder::KeyFinder &kf, int i) {
+        build_chroma(kf, tracks[i % nt], variants[i / nt], chroma[i]);
+    });
+
+    /* Replay per (configuration, track) */
+    std::vector<int> keys(configs.size() * nt);
+    std::vector<double> est_cpu(configs.size() * nt);
+    parallel_for((int)keys.size(), threads, [&](KeyFinder::KeyFinder &kf, int i) {
+        const Config &cfg = configs[i / nt];
+        keys[i] = replay(kf, cfg, chroma[cfg.variant * nt + i % nt], &est_cpu[i]);
+    });
+
+    for (int c = 0; c < (int)configs.size(); c++) {
+        Config &cfg = configs[c];
+        for (int t = 0; t < nt; t++) {
+            const Chroma &ch = chroma[cfg.variant * nt + t];
+            std::string got = key_names[keys[c * nt + t]];
+            cfg.total++;
+            if (got == tracks[t].expected) cfg.exact++;
+            if (got == tracks[t].expected || keys_are_relative(got, tracks[t].expected)) cfg.correct++;
+            cfg.cpu_s += ch.cpu_s + est_cpu[c * nt + t];
+            cfg.audio_s += ch.audio_s;
+        }
+    }
+
+    /* Cheapest first */
+    std::vector<int> order(configs.size());
+    for (int i = 0; i < (int)order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return configs[a].cpu_s / configs[a].audio_s < configs[b].cpu_s / configs[b].audio_s;
+    });
+
+    printf("window  hop   decay  ds  decim   exact   correct   cpu%%\n");
+    int pick = -1;
+    for (int i : order) {
+        const Config &cfg = configs[i];
+        const Variant &v = variants[cfg.variant];
+        double exact = 100.0 * cfg.exact / cfg.total;
+        double cpu = 100.0 * cfg.cpu_s / cfg.audio_s;
+        printf("%5.1fs %4.2fs  %5.2f  %2d  %-5s %6.1f%%  %6.1f%%  %6.2f\n",
+               cfg.window, cfg.hop, cfg.decay, v.downsample, decim_names[v.decim],
+               exact, 100.0 * cfg.correct / cfg.total, cpu);
+        if (pick < 0 && bar >= 0 && exact >= bar) pick = i;
+    }
+
+    if (bar >= 0) {
+        if (pick < 0) {
+            printf("\nNo configuration reaches %.1f%% exact\n", bar);
+        } else {
+            const Config &cfg = configs[pick];
+            const Variant &v = variants[cfg.variant];
+            printf("\nCheapest at >= %.1f%% exact: window %.1fs hop %.2fs decay %.2f "
+                   "downsample %d (%s), %.2f%% CPU\n", bar, cfg.window, cfg.hop, cfg.decay,
+                   v.downsample, decim_names[v.decim], 100.0 * cfg.cpu_s / cfg.audio_s);
+        }
+    }
+    return 0;
+}
@@ -2,13 +2,26 @@
  * test_direct.cpp - Direct libkeyfinder accuracy test
  *
  * Tests libkeyfinder directly (no wrapper) with full tracks and
- * windowed voting, to establish a proper accuracy baseline.
+ * windowed voting, to establish a proper accuracy baseline.  Tracks are
+ * streamed from a memory-mapped WAV, so long mixes run in constant memory,
+ * and their chroma is cached (chroma_cache.h) so re-runs only redo the key
+ * estimation:
+ *
+ *   test_direct [-w 4,8] [-x] [-c cache_dir] [-n]
+ *
+ * -w picks the window lengths, in seconds, for the chroma-window voting
+ * modes, which any number of sizes can share one cached chroma.  -x skips
+ * the original keyOfAudio voting modes, the only ones that still decode a
+ * cached track, so a warm run reads no audio at all.
  */
 
 #include <keyfinder/keyfinder.h>
 #include <keyfinder/audiodata.h>
 #include <keyfinder/constants.h>
 
+#include "wav_reader.h"
+#include "chroma_cache.h"
+
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -30,52 +43,6 @@ static const char* key_names[] = {
     "---"
 };
 
-/* ---- WAV reader ---- */
-
-struct WavFile {
-    int16_t *data;
-    int frames;
-    int channels;
-    int sample_rate;
-};
-
-static bool read_wav(const char *path, WavFile *wav) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return false;
-
-    char riff[4]; uint32_t file_size, fmt_tag;
-    fread(riff, 1, 4, f); fread(&file_size, 4, 1, f); fread(&fmt_tag, 1, 4, f);
-    if (memcmp(riff, "RIFF", 4) != 0) { fclose(f); return false; }
-
-    while (1) {
-        char id[4]; uint32_t sz;
-        if (fread(id, 1, 4, f) != 4) { fclose(f); return false; }
-        if (fread(&sz, 4, 1, f) != 1) { fclose(f); return false; }
-        if (memcmp(id, "fmt ", 4) == 0) {
-            uint16_t fmt, ch; uint32_t sr, br; uint16_t ba, bps;
-            fread(&fmt, 2, 1, f); fread(&ch, 2, 1, f);
-            fread(&sr, 4, 1, f); fread(&br, 4, 1, f);
-            fread(&ba, 2, 1, f); fread(&bps, 2, 1, f);
-            if (fmt != 1 || bps != 16) { fclose(f); return false; }
-            wav->channels = ch; wav->sample_rate = sr;
-            if (sz > 16) fseek(f, sz - 16, SEEK_CUR);
-            break;
-        } else fseek(f, sz, SEEK_CUR);
-    }
-
-    while (1) {
-        char id[4]; uint32_t sz;
-        if (fread(id, 1, 4, f) != 4) { fclose(f); return false; }
-        if (fread(&sz, 4, 1, f) != 1) { fclose(f); return false; }
-        if (memcmp(id, "data", 4) == 0) {
-            wav->frames = sz / (2 * wav->channels);
-            wav->data = (int16_t *)malloc(sz);
-            fread(wav->data, 1, sz, f);
-            fclose(f); return true;
-        } else fseek(f, sz, SEEK_CUR);
-    }
-}
-
 /* ---- Key comparison helpers ---- */
 
 static std::string normalize_key(const std::string &key) {
@@ -115,52 +82,151 @@ static bool keys_fifth_related(const std::string &a, const std::string &b) {
     return (diff == 7 || diff == 5) && ma == mb;
 }
 
-/* ---- Analysis modes ---- */
+/* ---- Analysis modes ----
+ *
+ * Everything is fed a block at a time, so memory stays constant whatever
+ * the track's length.  The full-track modes build each rate's chroma once
+ * and estimate from all of it.  The chroma-window voting modes split the
+ * 11025 Hz chroma into windows and vote their keys, so they come from the
+ * same cache entry at every window size.  The original voting modes
+ * classify each window's audio on its own with keyOfAudio, FFT frames
+ * never crossing a window edge; they're kept so their numbers stay
+ * comparable with earlier runs, and are recomputed every time. */
+
+#define READ_BLOCK 16384
+
+/* Chroma for a whole track through progressiveChromagram */
+struct TrackChroma {
+    KeyFinder::KeyFinder &kf;
+    KeyFinder::Workspace ws;
+    int rate;
+
+    TrackChroma(KeyFinder::KeyFinder &k, int r) : kf(k), rate(r) {}
+
+    void feed(const float *mono, int n) {
+        if (n <= 0) return;
+        KeyFinder::AudioData audio;
+        audio.setChannels(1);
+        audio.setFrameRate(rate);
+        audio.addToSampleCount(n);
+        for (int i = 0; i < n; i++) audio.setSample(i, mono[i]);
+        kf.progressiveChromagram(audio, ws);
+    }
 
-static std::string detect_full_track(const double *mono, int samples, int rate) {
-    KeyFinder::KeyFinder kf;
-    KeyFinder::AudioData audio;
-    audio.setChannels(1);
-    audio.setFrameRate(rate);
-    audio.addToSampleCount(samples);
-    for (int i = 0; i < samples; i++)
-        audio.setSample(i, mono[i]);
-    KeyFinder::key_t k = kf.keyOfAudio(audio);
+    /* Flush and copy the frames out, hop-major, at the float precision the
+     * cache keeps (so cached and fresh runs give identical keys) */
+    std::vector<float> finish(int *hops) {
+        kf.finalChromagram(ws);
+        std::vector<float> frames;
+        *hops = ws.chromagram ? (int)ws.chromagram->getHops() : 0;
+        frames.resize((size_t)*hops * KeyFinder::BANDS);
+        for (int h = 0; h < *hops; h++) {
+            for (unsigned b = 0; b < KeyFinder::BANDS; b++) {
+                frames[(size_t)h * KeyFinder::BANDS + b] = (float)ws.chromagram->getMagnitude(h, b);
+            }
+        }
+        return frames;
+    }
+};
+
+/* Key of frames [first, first + count) */
+static KeyFinder::key_t key_of_frames(KeyFinder::KeyFinder &kf, const float *frames,
+                                      int first, int count, int bands) {
+    KeyFinder::Workspace ws;
+    ws.chromagram = new KeyFinder::Chromagram(count);
+    for (int h = 0; h < count; h++) {
+        for (int b = 0; b < bands; b++) {
+            ws.chromagram->setMagnitude(h, b, frames[(size_t)(first + h) * bands + b]);
+        }
+    }
+    return kf.keyOfChromagram(ws);
+}
+
+static std::string full_key(KeyFinder::KeyFinder &kf, const float *frames, int hops, int bands) {
+    if (hops <= 0) return "---";
+    KeyFinder::key_t k = key_of_frames(kf, frames, 0, hops, bands);
     if (k >= 0 && k <= KeyFinder::SILENCE) return key_names[k];
     return "---";
 }
 
-static std::string detect_voting(const double *mono, int samples, int rate,
-                                  float window_sec) {
-    KeyFinder::KeyFinder kf;
-    int window_samples = (int)(window_sec * rate);
-    std::map<std::string, int> votes;
+/* Consecutive, non-overlapping windows of window_sec, each classified
+ * with keyOfAudio; a trailing partial window doesn't vote */
+struct Voting {
+    KeyFinder::KeyFinder &kf;
+    int rate;
+    std::vector<float> window;
+    int fill = 0;
+    std::vector<float> keys;   /* key index per window */
+
+    Voting(KeyFinder::KeyFinder &k, int r, float window_sec)
+        : kf(k), rate(r), window((size_t)(window_sec * r)) {}
+
+    void feed(const float *mono, int n) {
+        while (n > 0) {
+            int take = std::min(n, (int)window.size() - fill);
+            memcpy(window.data() + fill, mono, take * sizeof(float));
+            fill += take;
+            mono += take;
+            n -= take;
+            if (fill == (int)window.size()) {
+                classify();
+                fill = 0;
+            }
+        }
+    }
 
-    for (int offset = 0; offset + window_samples <= samples; offset += window_samples) {
+    void classify() {
         KeyFinder::AudioData audio;
         audio.setChannels(1);
         audio.setFrameRate(rate);
-        audio.addToSampleCount(window_samples);
-        for (int i = 0; i < window_samples; i++)
-            audio.setSample(i, mono[offset + i]);
-        KeyFinder::key_t k = kf.keyOfAudio(audio);
-        if (k >= 0 && k < KeyFinder::SILENCE) {
-            votes[key_names[k]]++;
-        }
+        audio.addToSampleCount(window.size());
+        for (size_t i = 0; i < window.size(); i++) audio.setSample(i, window[i]);
+        keys.push_back((float)kf.keyOfAudio(audio));
+    }
+};
+
+/* Keys of consecutive, non-overlapping windows of per_window frames
+ * each; a trailing partial window doesn't vote */
+static std::vector<float> chroma_window_keys(KeyFinder::KeyFinder &kf, const float *frames,
+                                             int hops, int bands, int per_window) {
+    std::vector<float> keys;
+    for (int first = 0; first + per_window <= hops; first += per_window) {
+        keys.push_back((float)key_of_frames(kf, frames, first, per_window, bands));
+    }
+    return keys;
+}
+
+/* Majority of the window keys; ties go to the first key name in
+ * alphabetical order */
+static std::string vote_key(const float *keys, int windows) {
+    std::map<std::string, int> votes;
+    for (int i = 0; i < windows; i++) {
+        int k = (int)keys[i];
+        if (k >= 0 && k < KeyFinder::SILENCE) votes[key_names[k]]++;
     }
 
     /* Find majority */
     std::string best = "---";
     int best_count = 0;
-    for (auto &[key, count] : votes) {
-        if (count > best_count) {
-            best_count = count;
-            best = key;
+    for (auto &v : votes) {
+        if (v.second > best_count) {
+            best_count = v.second;
+            best = v.first;
         }
     }
     return best;
 }
 
+/* One front end's chroma for a track: mapped from the cache, or computed */
+struct Frames {
+    chroma_file cached = {};
+    std::vector<float> fresh;
+    int hops = 0;
+
+    const float *data() const { return cached.map ? cached.frames : fresh.data(); }
+    ~Frames() { chroma_cache_close(&cached); }
+};
+
 /* ---- Score tracking ---- */
 
 struct Scores {
@@ -193,11 +259,35 @@ struct Scores {
     }
 };
 
-int main() {
+int main(int argc, char **argv) {
     const char *test_list = "test/test_files.txt";
     const char *audio_dir = "test/audio";
+    const char *cache_dir = "test/chroma_cache";
     const int DOWNSAMPLE = 4;
-    const int EFFECTIVE_RATE = 44100 / DOWNSAMPLE;
+    std::vector<float> window_secs = { 4.0f, 8.0f };
+    bool classic = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            window_secs.clear();
+            for (char *tok = strtok(argv[++i], ","); tok; tok = strtok(NULL, ",")) {
+                if (atof(tok) > 0) window_secs.push_back((float)atof(tok));
+            }
+        } else if (strcmp(argv[i], "-x") == 0) {
+            classic = false;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0) {
+            cache_dir = NULL;
+        } else {
+            fprintf(stderr, "Usage: %s [-w 4,8] [-x] [-c cache_dir] [-n]\n"
+                    "  -w  chroma-window voting lengths in seconds (default 4,8)\n"
+                    "  -x  skip the keyOfAudio voting modes, which always decode\n"
+                    "  -c  chroma cache directory (default test/chroma_cache)\n"
+                    "  -n  don't read or write the cache\n", argv[0]);
+            return 1;
+        }
+    }
 
     std::ifstream list(test_list);
     if (!list.is_open()) { fprintf(stderr, "Cannot open %s\n", test_list); return 1; }
@@ -216,61 +306,116 @@ int main() {
 
     /* Test multiple modes */
     Scores full_44k, full_11k, vote_4s, vote_8s;
+    std::vector<Scores> chroma_votes(window_secs.size());
+    KeyFinder::KeyFinder kf;
+    int cache_hits = 0;
 
     for (auto &tc : tests) {
         std::string wav_path = std::string(audio_dir) + "/" + tc.base + ".wav";
         std::string expected = normalize_key(tc.key);
 
-        WavFile wav = {};
-        if (!read_wav(wav_path.c_str(), &wav)) {
+        wav_reader wav;
+        if (!wav_open(&wav, wav_path.c_str())) {
             fprintf(stderr, "  SKIP %s\n", tc.base.c_str());
             continue;
         }
 
-        /* Convert to mono double at 44100 */
-        int frames = wav.frames;
-        std::vector<double> mono44(frames);
-        for (int i = 0; i < frames; i++) {
-            if (wav.channels == 2)
-                mono44[i] = (wav.data[i*2] + wav.data[i*2+1]) / 65536.0;
-            else
-                mono44[i] = wav.data[i] / 32768.0;
-        }
-
-        /* Downsample to 11025 (same as wrapper) */
-        int ds_frames = frames / DOWNSAMPLE;
-        std::vector<double> mono11(ds_frames);
-        for (int i = 0; i < ds_frames; i++)
-            mono11[i] = mono44[i * DOWNSAMPLE];
-
         printf("%-20s expected: %-8s  ", tc.base.c_str(), expected.c_str());
 
-        /* Mode 1: Full track at 44100 Hz */
-        std::string r1 = detect_full_track(mono44.data(), frames, 44100);
-        full_44k.record(tc.base, expected, r1);
+        /* One pass over the file drives the modes:
+         * 1. full track at the file rate (44100 Hz)
+         * 2. full track at 11025 Hz (same as wrapper's effective rate)
+         * 3./4. voting with 4s / 8s windows of audio at 11025 Hz
+         * 5... voting over -w windows of the 11025 Hz chroma */
+        int ds_rate = wav.sample_rate / DOWNSAMPLE;
+        char tag_full[CHROMA_CACHE_TAG_LEN], tag_ds[CHROMA_CACHE_TAG_LEN];
+        snprintf(tag_full, sizeof(tag_full), "%d", wav.sample_rate);
+        snprintf(tag_ds, sizeof(tag_ds), "%d-pick%d", ds_rate, DOWNSAMPLE);
+
+        uint64_t hash = 0;
+        Frames full, ds;
+        if (cache_dir) {
+            hash = chroma_hash(cache_dir, wav_path.c_str(), wav.map, wav.map_len);
+            if (chroma_cache_open(&full.cached, cache_dir, hash, tag_full)) full.hops = full.cached.hops;
+            if (chroma_cache_open(&ds.cached, cache_dir, hash, tag_ds)) ds.hops = ds.cached.hops;
+        }
+        if (full.cached.map && ds.cached.map) cache_hits++;
+
+        Voting vote4(kf, ds_rate, 4.0f), vote8(kf, ds_rate, 8.0f);
+        if (!full.cached.map || !ds.cached.map || classic) {
+            /* One pass over the file builds whatever is needed */
+            TrackChroma full_c(kf, wav.sample_rate), ds_c(kf, ds_rate);
+            static float mono[READ_BLOCK], mono_ds[READ_BLOCK];
+            int64_t pos = 0;
+            int n;
+            while ((n = wav_read_mono(&wav, mono, READ_BLOCK)) > 0) {
+                /* Downsample by picking every DOWNSAMPLE-th sample */
+                int m = 0;
+                for (int i = 0; i < n; i++) {
+                    if ((pos + i) % DOWNSAMPLE == 0) mono_ds[m++] = mono[i];
+                }
+                pos += n;
+
+                if (!full.cached.map) full_c.feed(mono, n);
+                if (!ds.cached.map) ds_c.feed(mono_ds, m);
+                if (classic) {
+                    vote4.feed(mono_ds, m);
+                    vote8.feed(mono_ds, m);
+                }
+            }
+
+            if (!full.cached.map) {
+                full.fresh = full_c.finish(&full.hops);
+                if (cache_dir) chroma_cache_store(cache_dir, hash, tag_full, wav.sample_rate,
+                                                  full.fresh.data(), full.hops, KeyFinder::BANDS);
+            }
+            if (!ds.cached.map) {
+                ds.fresh = ds_c.finish(&ds.hops);
+                if (cache_dir) chroma_cache_store(cache_dir, hash, tag_ds, ds_rate,
+                                                  ds.fresh.data(), ds.hops, KeyFinder::BANDS);
+            }
+        }
+        wav_close(&wav);
 
-        /* Mode 2: Full track at 11025 Hz (same as wrapper's effective rate) */
-        std::string r2 = detect_full_track(mono11.data(), ds_frames, EFFECTIVE_RATE);
+        const int bands = KeyFinder::BANDS;
+        std::string r1 = full_key(kf, full.data(), full.hops, bands);
+        std::string r2 = full_key(kf, ds.data(), ds.hops, bands);
+        full_44k.record(tc.base, expected, r1);
         full_11k.record(tc.base, expected, r2);
+        printf("full44k=%-8s full11k=%-8s ", r1.c_str(), r2.c_str());
+
+        if (classic) {
+            std::string r3 = vote_key(vote4.keys.data(), (int)vote4.keys.size());
+            std::string r4 = vote_key(vote8.keys.data(), (int)vote8.keys.size());
+            vote_4s.record(tc.base, expected, r3);
+            vote_8s.record(tc.base, expected, r4);
+            printf("vote4s=%-8s vote8s=%-8s ", r3.c_str(), r4.c_str());
+        }
 
-        /* Mode 3: Voting with 4s windows at 11025 Hz */
-        std::string r3 = detect_voting(mono11.data(), ds_frames, EFFECTIVE_RATE, 4.0);
-        vote_4s.record(tc.base, expected, r3);
-
-        /* Mode 4: Voting with 8s windows at 11025 Hz */
-        std::string r4 = detect_voting(mono11.data(), ds_frames, EFFECTIVE_RATE, 8.0);
-        vote_8s.record(tc.base, expected, r4);
-
-        printf("full44k=%-8s full11k=%-8s vote4s=%-8s vote8s=%-8s\n",
-               r1.c_str(), r2.c_str(), r3.c_str(), r4.c_str());
-
-        free(wav.data);
+        for (size_t w = 0; w < window_secs.size(); w++) {
+            /* A window of audio holds one frame per chroma hop */
+            int per_window = std::max(1, (int)(window_secs[w] * ds_rate / KeyFinder::HOPSIZE + 0.5f));
+            std::vector<float> keys = chroma_window_keys(kf, ds.data(), ds.hops, bands, per_window);
+            std::string r = vote_key(keys.data(), (int)keys.size());
+            chroma_votes[w].record(tc.base, expected, r);
+            printf("cvote%gs=%-8s ", window_secs[w], r.c_str());
+        }
+        printf("\n");
     }
 
+    if (cache_dir) printf("\nChroma cache: %d / %zu tracks from %s\n", cache_hits, tests.size(), cache_dir);
+
     full_44k.print("Full track @ 44100 Hz");
     full_11k.print("Full track @ 11025 Hz (downsampled)");
-    vote_4s.print("4s window voting @ 11025 Hz");
-    vote_8s.print("8s window voting @ 11025 Hz");
+    if (classic) {
+        vote_4s.print("4s window voting @ 11025 Hz");
+        vote_8s.print("8s window voting @ 11025 Hz");
+    }
+    for (size_t w = 0; w < window_secs.size(); w++) {
+        char label[64];
+        snprintf(label, sizeof(label), "%gs chroma-window voting @ 11025 Hz", window_secs[w]);
+        chroma_votes[w].print(label);
+    }
 
     return 0;
 }
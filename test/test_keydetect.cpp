@@ -1,17 +1,23 @@
 /*
  * test_keydetect.cpp - Accuracy test for key detection using GiantSteps dataset
  *
- * Reads WAV files, feeds them through the kd_* wrapper API,
- * and compares detected key with ground truth annotations.
+ * Reads WAV files, runs them through the kd_* wrapper API with
+ * kd_analyze_buffer, and compares detected key with ground truth
+ * annotations.
+ *
+ * It reads no chroma cache: the wrapper takes its chroma internally, so
+ * this checks the real code path end to end, one -w per run.  Comparing
+ * window lengths (or hops, decays and downsamplers) is sweep.cpp's job,
+ * which decodes and analyses each track once for the whole grid.
  */
 
 #include "../src/dsp/keyfinder_wrapper.h"
+#include "wav_reader.h"
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cstdint>
-#include <unistd.h>
 #include <string>
 #include <vector>
 #include <map>
@@ -19,86 +25,6 @@
 #include <sstream>
 #include <algorithm>
 
-/* ---- Simple WAV reader (PCM16 stereo only) ---- */
-
-struct WavFile {
-    int16_t *data;
-    int frames;
-    int channels;
-    int sample_rate;
-};
-
-static bool read_wav(const char *path, WavFile *wav) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return false;
-
-    /* RIFF header */
-    char riff[4];
-    uint32_t file_size, fmt_tag;
-    fread(riff, 1, 4, f);
-    fread(&file_size, 4, 1, f);
-    fread(&fmt_tag, 1, 4, f);
-    if (memcmp(riff, "RIFF", 4) != 0) { fclose(f); return false; }
-
-    /* Find fmt chunk */
-    while (1) {
-        char chunk_id[4];
-        uint32_t chunk_size;
-        if (fread(chunk_id, 1, 4, f) != 4) { fclose(f); return false; }
-        if (fread(&chunk_size, 4, 1, f) != 1) { fclose(f); return false; }
-
-        if (memcmp(chunk_id, "fmt ", 4) == 0) {
-            uint16_t audio_fmt, num_channels;
-            uint32_t sample_rate, byte_rate;
-            uint16_t block_align, bits_per_sample;
-            fread(&audio_fmt, 2, 1, f);
-            fread(&num_channels, 2, 1, f);
-            fread(&sample_rate, 4, 1, f);
-            fread(&byte_rate, 4, 1, f);
-            fread(&block_align, 2, 1, f);
-            fread(&bits_per_sample, 2, 1, f);
-
-            if (audio_fmt != 1 || bits_per_sample != 16) {
-                fprintf(stderr, "  Unsupported WAV format: fmt=%d bits=%d\n",
-                        audio_fmt, bits_per_sample);
-                fclose(f);
-                return false;
-            }
-            wav->channels = num_channels;
-            wav->sample_rate = sample_rate;
-
-            /* Skip any extra fmt bytes */
-            if (chunk_size > 16)
-                fseek(f, chunk_size - 16, SEEK_CUR);
-            break;
-        } else {
-            fseek(f, chunk_size, SEEK_CUR);
-        }
-    }
-
-    /* Find data chunk */
-    while (1) {
-        char chunk_id[4];
-        uint32_t chunk_size;
-        if (fread(chunk_id, 1, 4, f) != 4) { fclose(f); return false; }
-        if (fread(&chunk_size, 4, 1, f) != 1) { fclose(f); return false; }
-
-        if (memcmp(chunk_id, "data", 4) == 0) {
-            int total_samples = chunk_size / 2;
-            wav->frames = total_samples / wav->channels;
-            wav->data = (int16_t *)malloc(chunk_size);
-            fread(wav->data, 1, chunk_size, f);
-            fclose(f);
-            return true;
-        } else {
-            fseek(f, chunk_size, SEEK_CUR);
-        }
-    }
-
-    fclose(f);
-    return false;
-}
-
 /* ---- Key name normalization ---- */
 
 /* Convert GiantSteps format "C minor" to wrapper format "C min" */
@@ -218,55 +144,38 @@ int main(int argc, char **argv) {
         std::string expected = normalize_key(tc.expected_key);
 
         /* Read WAV */
-        WavFile wav = {};
-        if (!read_wav(wav_path.c_str(), &wav)) {
+        wav_reader wav;
+        if (!wav_open(&wav, wav_path.c_str())) {
             fprintf(stderr, "  SKIP %s (cannot read WAV)\n", tc.base.c_str());
             continue;
         }
-
-        /* Ensure stereo */
-        int16_t *stereo = wav.data;
-        int frames = wav.frames;
-        bool free_stereo = false;
-
-        if (wav.channels == 1) {
-            /* Duplicate mono to stereo */
-            stereo = (int16_t *)malloc(frames * 2 * sizeof(int16_t));
-            free_stereo = true;
-            for (int i = 0; i < frames; i++) {
-                stereo[i * 2] = wav.data[i];
-                stereo[i * 2 + 1] = wav.data[i];
-            }
-        }
+        int frames = (int)wav.frames;
 
         /* Create key detector */
         void *kd = kd_create(wav.sample_rate);
+        if (!kd) {
+            fprintf(stderr, "  SKIP %s (unsupported rate %d)\n",
+                    tc.base.c_str(), wav.sample_rate);
+            wav_close(&wav);
+            continue;
+        }
         kd_set_window(kd, window_seconds);
 
-        /* Feed audio in 128-frame blocks (matching Move's block size).
-         * To get multiple analyses, feed the whole file. */
-        int block_size = 128;
-        int fed = 0;
-        int analyses_possible = 0;
+        /* Run the whole file through the wrapper pipeline synchronously:
+         * same resampling, chroma and voting as kd_feed, no waiting on the
+         * analysis thread, so results are reproducible */
         int window_frames = (int)(window_seconds * wav.sample_rate);
-
-        for (int pos = 0; pos < frames; pos += block_size) {
-            int n = std::min(block_size, frames - pos);
-            kd_feed(kd, stereo + pos * 2, n);
-            fed += n;
-
-            /* Count how many windows we've completed */
-            if (fed >= window_frames) {
-                analyses_possible++;
-            }
+        kd_result result;
+        int have_key = 0;
+        static int16_t block[65536 * 2];   /* streamed from the mapping */
+        int n;
+        while ((n = wav_read_s16_stereo(&wav, block, 65536)) > 0) {
+            have_key = kd_analyze_buffer(kd, block, n, &result);
         }
 
-        /* Wait for analysis thread to finish processing */
-        usleep(500000);  /* 500ms should be plenty */
-
         /* Read result */
         char detected[64] = {};
-        kd_get_key(kd, detected, sizeof(detected));
+        snprintf(detected, sizeof(detected), "%s", kd_key_name(have_key ? result.key : -1));
 
         /* Compare */
         std::string det(detected);
@@ -299,8 +208,7 @@ int main(int argc, char **argv) {
         }
 
         kd_destroy(kd);
-        free(wav.data);
-        if (free_stereo) free(stereo);
+        wav_close(&wav);
     }
 
     printf("\n=== Results (window=%.1fs, n=%d) ===\n", window_seconds, total);
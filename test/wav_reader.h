@@ -0,0 +1,190 @@
+/*
+ * wav_reader.h - Memory-mapped, streaming WAV reader for the test tools
+ *
+ * Maps the file and converts sample frames on demand, a block at a time,
+ * so memory use doesn't grow with track length (the kernel pages the
+ * mapping in and out).  Handles 8/16/24/32-bit integer PCM, 32/64-bit
+ * float and WAVE_FORMAT_EXTENSIBLE, any channel count.
+ *
+ * Header-only; shared by test_keydetect, test_direct and batch_keydetect.
+ */
+
+#ifndef WAV_READER_H
+#define WAV_READER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WAV_FORMAT_PCM        0x0001
+#define WAV_FORMAT_FLOAT      0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+struct wav_reader {
+    const uint8_t *map;
+    size_t map_len;
+    const uint8_t *data;   /* first sample frame */
+    int64_t frames;
+    int64_t pos;           /* next frame to read */
+    int channels;
+    int sample_rate;
+    int bits;
+    int format;            /* WAV_FORMAT_PCM or WAV_FORMAT_FLOAT */
+    int frame_bytes;
+};
+
+static inline uint32_t wav_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t wav_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline void wav_close(wav_reader *r) {
+    if (r->map) munmap((void*)r->map, r->map_len);
+    r->map = NULL;
+}
+
+/* Open and map a WAV file.  Returns false (with a message on stderr for
+ * unsupported formats) if it can't be read. */
+static inline bool wav_open(wav_reader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12) { close(fd); return false; }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    r->map = (const uint8_t*)map;
+    r->map_len = (size_t)st.st_size;
+    madvise(map, r->map_len, MADV_SEQUENTIAL);
+
+    const uint8_t *p = r->map;
+    const uint8_t *end = r->map + r->map_len;
+    if (memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+        wav_close(r);
+        return false;
+    }
+
+    bool have_fmt = false;
+    for (p += 12; p + 8 <= end; ) {
+        uint32_t size = wav_le32(p + 4);
+        const uint8_t *body = p + 8;
+        size_t avail = (size_t)(end - body);
+
+        if (memcmp(p, "fmt ", 4) == 0 && size >= 16 && avail >= 16) {
+            int fmt = wav_le16(body);
+            r->channels = wav_le16(body + 2);
+            r->sample_rate = (int)wav_le32(body + 4);
+            r->bits = wav_le16(body + 14);
+            /* Extensible: the real format code leads the SubFormat GUID */
+            if (fmt == WAV_FORMAT_EXTENSIBLE && size >= 40 && avail >= 40) {
+                fmt = wav_le16(body + 24);
+            }
+            r->format = fmt;
+            have_fmt = true;
+        } else if (memcmp(p, "data", 4) == 0 && have_fmt) {
+            bool ok = r->channels > 0 && r->sample_rate > 0 &&
+                      ((r->format == WAV_FORMAT_PCM &&
+                        (r->bits == 8 || r->bits == 16 || r->bits == 24 || r->bits == 32)) ||
+                       (r->format == WAV_FORMAT_FLOAT && (r->bits == 32 || r->bits == 64)));
+            if (!ok) {
+                fprintf(stderr, "  Unsupported WAV format: fmt=%d bits=%d channels=%d\n",
+                        r->format, r->bits, r->channels);
+                wav_close(r);
+                return false;
+            }
+            r->frame_bytes = r->channels * r->bits / 8;
+            /* Streamed files may leave the size at 0 or 0xFFFFFFFF */
+            size_t bytes = size < avail && size != 0 ? size : avail;
+            r->data = body;
+            r->frames = (int64_t)(bytes / r->frame_bytes);
+            return true;
+        }
+
+        if (size > avail) break;
+        p = body + size + (size & 1);
+    }
+
+    wav_close(r);
+    return false;
+}
+
+static inline void wav_seek(wav_reader *r, int64_t frame) {
+    if (frame < 0) frame = 0;
+    if (frame > r->frames) frame = r->frames;
+    r->pos = frame;
+}
+
+/* One sample as float in [-1, 1) */
+static inline float wav_sample(const wav_reader *r, const uint8_t *s) {
+    if (r->format == WAV_FORMAT_FLOAT) {
+        if (r->bits == 32) { float f; memcpy(&f, s, 4); return f; }
+        double d; memcpy(&d, s, 8); return (float)d;
+    }
+    switch (r->bits) {
+    case 8:  return ((int)s[0] - 128) * (1.0f / 128.0f);
+    case 16: return (int16_t)wav_le16(s) * (1.0f / 32768.0f);
+    case 24: return (int32_t)(((uint32_t)s[0] << 8) | ((uint32_t)s[1] << 16) |
+                              ((uint32_t)s[2] << 24)) * (1.0f / 2147483648.0f);
+    default: return (int32_t)wav_le32(s) * (1.0f / 2147483648.0f);
+    }
+}
+
+static inline int16_t wav_to_s16(float v) {
+    float s = v * 32768.0f;
+    if (s >= 32767.0f) return 32767;
+    if (s <= -32768.0f) return -32768;
+    return (int16_t)(s < 0.0f ? s - 0.5f : s + 0.5f);
+}
+
+/* Read up to max_frames as stereo interleaved int16 (what kd_feed takes):
+ * mono is duplicated, extra channels beyond two are dropped.  16-bit
+ * stereo is copied straight from the mapping.  Returns frames read. */
+static inline int wav_read_s16_stereo(wav_reader *r, int16_t *out, int max_frames) {
+    int64_t left = r->frames - r->pos;
+    int n = left < max_frames ? (int)left : max_frames;
+    if (n <= 0) return 0;
+
+    const uint8_t *src = r->data + r->pos * r->frame_bytes;
+    if (r->format == WAV_FORMAT_PCM && r->bits == 16 && r->channels == 2) {
+        memcpy(out, src, (size_t)n * 4);   /* little-endian host assumed, as elsewhere */
+    } else {
+        int bps = r->bits / 8;
+        for (int i = 0; i < n; i++, src += r->frame_bytes) {
+            float l = wav_sample(r, src);
+            float rt = r->channels > 1 ? wav_sample(r, src + bps) : l;
+            out[i * 2] = wav_to_s16(l);
+            out[i * 2 + 1] = wav_to_s16(rt);
+        }
+    }
+    r->pos += n;
+    return n;
+}
+
+/* Read up to max_frames averaged to mono float.  Returns frames read. */
+static inline int wav_read_mono(wav_reader *r, float *out, int max_frames) {
+    int64_t left = r->frames - r->pos;
+    int n = left < max_frames ? (int)left : max_frames;
+    if (n <= 0) return 0;
+
+    const uint8_t *src = r->data + r->pos * r->frame_bytes;
+    int bps = r->bits / 8;
+    float scale = 1.0f / r->channels;
+    for (int i = 0; i < n; i++, src += r->frame_bytes) {
+        float sum = 0.0f;
+        for (int c = 0; c < r->channels; c++) sum += wav_sample(r, src + c * bps);
+        out[i] = sum * scale;
+    }
+    r->pos += n;
+    return n;
+}
+
+#endif /* WAV_READER_H */